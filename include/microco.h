@@ -9,10 +9,11 @@
  * - Cooperative coroutine via yield and resume
  * - Coroutine sleep
  * 
- * For now it has these limitations:
- * - Implemented for STM23L0. But might be easy to modify for other arm processors.
- * - Cannot start a coroutine from another coroutine
- * - Cannot directly pass parameters through yield nor resume.
+ * Ports (see src/microco_port.h):
+ * - Cortex-M0/M0+ (STM32L0) and Cortex-M3/M4/M7, time source HAL_GetTick.
+ *   With an FPU, s16-s31 are only saved for coroutines that used it.
+ * - RV32 machine mode, time source co_port_get_tick provided by the application.
+ * - Linux host on x86-64 and AArch64, for building and benchmarking off-target.
  *
  * Usage Notes:
  *   - Do not call coroutine functions directly; use co_resume to start/resume.
@@ -24,11 +25,154 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Build options, define to 1 on the compiler command line to enable. */
+
+/* Paint the whole stack in co_init instead of only its 16 bottom words, so
+   co_stack_used reports the real high-water mark. Costs the paint loop in
+   co_init.
+*/
+#ifndef CO_STACK_PAINT
+#define CO_STACK_PAINT 0
+#endif
+
+/* Hardware stack overflow guard. The incoming coroutine gets a no-access
+   MPU region over the 32 bottom bytes of its stack on ARMv6-M and ARMv7-M
+   (stacks must then be 32-byte aligned), or MSPLIM set to its stack bottom
+   on ARMv8-M Mainline. Also define it for the assembler. Not available on
+   the RV32 and host ports.
+*/
+#ifndef CO_STACK_GUARD
+#define CO_STACK_GUARD 0
+#endif
+
+/* Shared stack mode, for parts with very little RAM. Coroutines initialized
+   with co_init_shared all run on the one stack given to co_shared_stack.
+   When another shared coroutine needs it, only the part a coroutine
+   actually uses is copied out to its own small save buffer, and copied back
+   before it runs again.
+*/
+#ifndef CO_SHARED_STACK
+#define CO_SHARED_STACK 0
+#endif
+
+/* Stack queries: co_stack_used, co_stack_free, co_stack_summary, and
+   co_reset, which restarts a coroutine on the stack it was given. co_t
+   keeps its stack buffer and a link in the list of coroutines (16 bytes),
+   and co_init paints the bottom of the stack. CO_STACK_PAINT and
+   CO_STACK_GUARD turn it on, the guard needs the stack bottom as well.
+*/
+#ifndef CO_STACK_INFO
+#define CO_STACK_INFO 0
+#endif
+
+#if (CO_STACK_PAINT || CO_STACK_GUARD) && !CO_STACK_INFO
+#undef CO_STACK_INFO
+#define CO_STACK_INFO 1
+#endif
+
+/* Nested resume: co_resume and co_resume_with from a coroutine, which waits
+   until the coroutine it resumed gives control back. co_t keeps the context
+   that resumed it (4 bytes). Without it, coroutines are resumed from the
+   main context and always return there.
+*/
+#ifndef CO_NESTED_RESUME
+#define CO_NESTED_RESUME 0
+#endif
+
+/* co_join and co_remove. co_t keeps the coroutine joining it and where it
+   waits itself, an event or a co_join, so co_remove can take it out
+   (8 bytes).
+*/
+#ifndef CO_JOIN
+#define CO_JOIN 0
+#endif
+
+/* Number of priority levels of the ready queue, 1 to 32. Level
+   CO_PRIORITIES - 1 runs first, coroutines and tasks start at 0. With 1,
+   co_loop runs them in the order they became ready.
+*/
+#ifndef CO_PRIORITIES
+#define CO_PRIORITIES 1
+#endif
+
+#if (CO_PRIORITIES < 1) || (CO_PRIORITIES > 32)
+#error "microco: CO_PRIORITIES must be between 1 and 32"
+#endif
+
+/* Per coroutine CPU time: run time, number of runs and longest run,
+   counted at every context switch with the port's co_port_cpu_time
+   (SysTick clocks on Cortex-M, mcycle on RV32, ns on the host). Adds 24
+   bytes to co_t and a few dozen cycles per switch.
+*/
+#ifndef CO_CPU_STATS
+#define CO_CPU_STATS 0
+#endif
+
+/* Scheduler trace: every switch, wait, sleep, wakeup and finish goes as an
+   8-byte record into a RAM ring of CO_TRACE_SIZE records (a power of two),
+   read out with co_trace_drain. Define CO_TRACE_SECTION to a section that
+   startup code does not clear (".noinit" for example) to keep the trace of
+   the run before a reset.
+*/
+#ifndef CO_TRACE
+#define CO_TRACE 0
+#endif
+#ifndef CO_TRACE_SIZE
+#define CO_TRACE_SIZE 256
+#endif
+/* Cortex-M: right shift applied to SysTick->VAL in trace timestamps, so
+   that SysTick LOAD >> CO_TRACE_VAL_SHIFT fits in 16 bits: 0 is enough up
+   to a 65 MHz SysTick clock with a 1 ms tick, 1 up to 131 MHz.
+*/
+#ifndef CO_TRACE_VAL_SHIFT
+#define CO_TRACE_VAL_SHIFT 0
+#endif
+
+#if CO_TRACE && ((CO_TRACE_SIZE < 2) || (CO_TRACE_SIZE & (CO_TRACE_SIZE - 1)))
+#error "microco: CO_TRACE_SIZE must be a power of two"
+#endif
+
+/* Spawn pool for co_spawn: a static arena of co_t and stacks in three size
+   classes, COUNT slots of SIZE bytes each (at most 32 slots per class).
+   The pool is built in when any count is not 0. Stack sizes are multiples
+   of 8, or of 32 with CO_STACK_GUARD.
+*/
+#ifndef CO_POOL_SMALL_COUNT
+#define CO_POOL_SMALL_COUNT 0
+#endif
+#ifndef CO_POOL_SMALL_SIZE
+#define CO_POOL_SMALL_SIZE 512
+#endif
+#ifndef CO_POOL_MEDIUM_COUNT
+#define CO_POOL_MEDIUM_COUNT 0
+#endif
+#ifndef CO_POOL_MEDIUM_SIZE
+#define CO_POOL_MEDIUM_SIZE 1024
+#endif
+#ifndef CO_POOL_LARGE_COUNT
+#define CO_POOL_LARGE_COUNT 0
+#endif
+#ifndef CO_POOL_LARGE_SIZE
+#define CO_POOL_LARGE_SIZE 2048
+#endif
+
+#define CO_POOL ((CO_POOL_SMALL_COUNT + CO_POOL_MEDIUM_COUNT + CO_POOL_LARGE_COUNT) > 0)
+
+#if (CO_POOL_SMALL_COUNT > 32) || (CO_POOL_MEDIUM_COUNT > 32) || (CO_POOL_LARGE_COUNT > 32)
+#error "microco: at most 32 pool slots per size class"
+#endif
+
+/* Value painted on unused stack */
+#define CO_STACK_PAINT_WORD 0xDEADBEEFu
+
 /* Coroutine function type.
    All coroutine functions must match this signature.
 */
 typedef void (*co_func)(void);
 
+/* Coroutine function type taking an argument, see co_init_arg */
+typedef void (*co_func_arg)(void *arg);
+
 typedef enum {
     CO_STATUS_IDLE,     // Coroutine just created
     CO_STATUS_MAIN,     // Not a real status, represents the main context which cannot yield nor be resumed
@@ -39,38 +183,283 @@ typedef enum {
     CO_STATUS_FINISHED  // Coroutine function returned. Cannot be resumed anymore.
 } co_status_t;
 
+/* Scheduling state shared by coroutines and stackless tasks, so both go
+   through the same ready queue and sleep list. First member of co_t and
+   co_task_t.
+*/
+typedef struct co_node_t {
+    struct co_node_t *ready_next;  /* ready queue link */
+    struct co_node_t *sleep_next;  /* sleep list link, sorted by deadline */
+    struct co_node_t *sleep_prev;  /* previous in the sleep list, O(1) removal */
+    uint32_t     sleep_until; /* sleep until timestamp */
+    uint8_t      status;      /* co_status_t */
+    uint8_t      queued;      /* in the ready queue */
+    uint8_t      wake_pending;/* resumed from interrupt while still running */
+    uint8_t      sleeping;    /* in the sleep list */
+    uint8_t      task;        /* co_task_t, not co_t */
+    uint8_t      prio;        /* ready queue level, higher runs first */
+    uint8_t      timed_out;   /* last timed wait ended by its deadline */
+    uint8_t      with_arg;    /* co_init_arg coroutine, fn takes an argument */
+} co_node_t;
+
 typedef struct co_t {
+    co_node_t    node;        /* scheduling state, must be first */
     uint32_t    *sp;          /* saved stack pointer */
-    co_func      fn;          /* entry function */
+#if CO_STACK_INFO
+    uint32_t    *stack_base;  /* lowest address of the stack buffer, right after sp */
+    uint32_t     stack_size;  /* size of the stack buffer in bytes */
+#endif
+    co_func      fn;          /* entry function, a co_func_arg with co_init_arg */
+    uint32_t     key;         /* set from its address by co_init, cleared when finished */
+#if CO_STACK_INFO
     struct co_t *next;        /* linked list of coroutines */
-    uint32_t     sleep_until; /* sleep until timestamp */
-    co_status_t  status;      /* finished flag */
+    struct co_t *prev;        /* previous in that list, unlinks in O(1) */
+#endif
+#if CO_JOIN
+    co_node_t   *joiner;      /* coroutine waiting in co_join */
+    co_node_t *volatile *wait_slot; /* event waiter or joiner slot holding it */
+#endif
+#if CO_NESTED_RESUME
+    struct co_t *caller;      /* context that resumed it, where co_yield returns */
+#endif
+#if CO_CPU_STATS
+    uint64_t     cpu_time;    /* total run time, co_cpu_now units */
+    uint32_t     cpu_runs;    /* times switched in */
+    uint32_t     cpu_max;     /* longest single run */
+    uint32_t     cpu_start;   /* co_cpu_now when last switched in */
+#endif
+#if CO_STACK_GUARD
+    uint32_t     guard[2];    /* port specific guard setup, MPU RBAR/RASR */
+#endif
+#if CO_SHARED_STACK
+    uint32_t    *save_buf;    /* shared stack mode: save buffer, NULL otherwise */
+    uint32_t     save_size;   /* size of the save buffer in bytes */
+    uint32_t     saved;       /* bytes of stack held in the save buffer */
+#endif
 } co_t;
 
+/* Current status of a coroutine */
+static inline co_status_t co_status(const co_t *co) {
+    return (co_status_t)co->node.status;
+}
+
 /* Initialize a coroutine with a user-provided stack buffer.
    The stack buffer must be large enough to hold the coroutine's stack.
    The stack must be 8-byte aligned.
+
+   Initializing a coroutine that is in use (ready, running, waiting or
+   sleeping) is an error. A finished or never resumed one can be initialized
+   again; co_reset does that without the stack arguments. The co_t needs no
+   zeroing: co_init gives it a key derived from its address, which only a
+   coroutine initialized and not finished since holds. It must stay valid
+   until the coroutine finishes or is removed.
 */
 void co_init(co_t *co, void *stack_mem, size_t stack_bytes,
                            co_func fn);
 
-/* Returns control to the main context. When the coroutine is resumed is like
-   if this function simply returned.
+
+/* Same as co_init, for a function taking an argument. arg is kept in the
+   initial frame on the coroutine stack, not in co_t, and fn(arg) is called
+   on the first resume. One function can then drive several instances:
+
+     co_init_arg(&co_uart1, stack1, sizeof(stack1), uart_worker, &uart1);
+     co_init_arg(&co_uart2, stack2, sizeof(stack2), uart_worker, &uart2);
+*/
+void co_init_arg(co_t *co, void *stack_mem, size_t stack_bytes,
+                           co_func_arg fn, void *arg);
+
+#if CO_SHARED_STACK
+/* Set the stack shared by all coroutines initialized with co_init_shared.
+   Call it once, before co_init_shared. The stack must be 8-byte aligned and
+   sized for the deepest of them.
+*/
+void co_shared_stack(void *stack_mem, size_t stack_bytes);
+
+/* Initialize a coroutine that runs on the shared stack. save_mem receives
+   its used stack while another shared coroutine runs: it must be 4-byte
+   aligned and hold the deepest stack the coroutine has at a co_yield,
+   co_sleep or co_transfer (co_port_break otherwise), not its worst case.
+
+   The copy happens off the shared stack, so a shared coroutine is switched
+   in from the main context or an ordinary coroutine (co_resume, co_loop),
+   and not while the coroutine holding the shared stack is up the caller
+   chain. co_transfer and co_yield_next from a shared coroutine to another
+   one that does not hold the shared stack go through the caller instead of
+   switching directly. Resuming the coroutine that already holds the shared
+   stack copies nothing.
+
+   While swapped out, its locals are not in memory at their address: do not
+   hand pointers to them to interrupts, DMA or other coroutines across a
+   yield.
+*/
+void co_init_shared(co_t *co, void *save_mem, size_t save_bytes,
+                           co_func fn);
+#endif
+
+#if CO_POOL
+/* Size classes of the spawn pool */
+typedef enum {
+    CO_POOL_SMALL,      // CO_POOL_SMALL_SIZE byte stacks
+    CO_POOL_MEDIUM,     // CO_POOL_MEDIUM_SIZE byte stacks
+    CO_POOL_LARGE,      // CO_POOL_LARGE_SIZE byte stacks
+    CO_POOL_CLASSES
+} co_pool_class_t;
+
+/* Start fn(arg) on a co_t and stack taken from the pool, for short jobs
+   started at run time without a heap. Returns NULL when every slot of the
+   class is taken. The coroutine is made ready and runs from the next
+   co_loop (or a co_yield_next). Its slot goes back to the pool when fn
+   returns.
+
+   Each class keeps a bitmap of free slots, taken with the same highest-bit
+   lookup as the ready queue, and a class never fragments. The coroutine
+   list is doubly linked, so neither co_spawn nor the release on return
+   depends on how many coroutines exist. What remains is co_init painting
+   the stack with CO_STACK_INFO (16 words, the whole slab with
+   CO_STACK_PAINT) and, if the job was woken while finishing, dropping that
+   stale ready queue entry. The returned co_t can be joined with CO_JOIN; it
+   stays valid until the next co_spawn of its class reuses it. Do not
+   co_reset it. Must not be called from an interrupt handler.
+*/
+co_t *co_spawn(co_func_arg fn, void *arg, co_pool_class_t size_class);
+
+typedef struct {
+    size_t  stack_size; /* bytes per stack */
+    size_t  count;      /* slots */
+    size_t  used;       /* slots running a coroutine now */
+    size_t  peak;       /* most slots ever used at once */
+} co_pool_info_t;
+
+/* Occupancy of a size class */
+void co_pool_info(co_pool_class_t size_class, co_pool_info_t *info);
+#endif
+
+/* Returns control to the context that resumed the coroutine: the main
+   context, or the coroutine that called co_resume. When the coroutine is
+   resumed is like if this function simply returned.
 
    Must be called from within a coroutine initialized with co_init and resumed
    with co_resume. That means, do not call the coroutine function directly.
 */
 void co_yield(void);
 
+#if CO_JOIN
+/* Wait until co finishes. Returns at once if it already has. At most one
+   coroutine joins a given coroutine at a time. Must be called from within a
+   coroutine, the main context checks co_status instead.
+*/
+void co_join(co_t *co);
+
+/* Cancel a coroutine that is not running: take it off the ready queue, the
+   sleep list and the event or co_join it waits for, and mark it finished as
+   if its function had returned (its joiner is woken up, a co_spawn slot goes
+   back to the pool). Its stack is dropped as it is, nothing on it gets to
+   clean up. Removing a finished coroutine does nothing; the running one and
+   the ones up its caller chain cannot be removed.
+*/
+void co_remove(co_t *co);
+#endif
+
+#if CO_STACK_INFO
+/* Restart a finished (or never resumed) coroutine on the stack it was
+   initialized with, without registering it again. The next co_resume calls
+   its function from the start. co_reset_arg gives a new argument to a
+   coroutine initialized with co_init_arg; co_reset passes it NULL. Its
+   priority is kept.
+*/
+void co_reset(co_t *co);
+void co_reset_arg(co_t *co, void *arg);
+#endif
+
+/* Result of the waits with a timeout */
+typedef enum {
+    CO_WAIT_WOKEN,      // Resumed or signaled before the deadline
+    CO_WAIT_TIMEOUT     // The deadline came first
+} co_wait_t;
+
+/* Timeout meaning no timeout. Any other timeout given to co_yield_timeout,
+   co_event_wait_timeout or co_chan_read_timeout must stay below 2^31 ms:
+   the deadlines share the sleep list and its signed comparisons.
+*/
+#define CO_WAIT_FOREVER 0xFFFFFFFFu
+
+/* Same as co_yield, but also resumed after ms if nothing else resumed it
+   before. The coroutine sits in the sleep list meanwhile, so co_loop checks
+   the deadline along with the sleepers at no extra cost. With
+   CO_WAIT_FOREVER it waits as co_yield does.
+*/
+co_wait_t co_yield_timeout(uint32_t ms);
+
+/* Switch directly from the running coroutine to next, without going back to
+   the main context: one context switch instead of two plus a co_loop pass.
+   The running coroutine then waits to be resumed, as with co_yield. When
+   next yields, sleeps or finishes, control goes to the caller of the
+   running coroutine.
+
+   Must be called from within a coroutine. next must not be running nor
+   finished.
+*/
+void co_transfer(co_t *next);
+
+/* Same as co_yield, but if another coroutine was made ready by a co_resume
+   from interrupt, switch to it directly instead of returning to the main
+   context and waiting for co_loop.
+
+   Must be called from within a coroutine.
+*/
+void co_yield_next(void);
+
 /* Start or resume a coroutine.
 
-   Must be called from the main context or
-   an interrupt handler.
+   Must be called from the main context, an interrupt handler or, with
+   CO_NESTED_RESUME, a coroutine (co_port_break otherwise).
+
+   From a coroutine the resume is nested: the child runs right away and its
+   next co_yield, co_sleep or wait (or its end) returns to the parent,
+   without a trip through the main context and co_loop. Each coroutine keeps
+   the context that resumed it last, so parents can nest further; every
+   coroutine up the chain stays running until its child gives control back.
+   A child resumed again later by co_loop returns to the main context.
+
+   From an interrupt handler the coroutine is queued and run by the next
+   co_loop, in the order of the calls. If it is still running (the interrupt
+   fired before it reached co_yield), its next co_yield returns immediately
+   instead of losing the wakeup.
 */
 void co_resume(co_t *co);
 
+/* Generator style value passing. The value goes through context_switch in
+   registers, no copy and no global is involved.
+
+   co_yield_value hands value to its caller, where the co_resume_with
+   that ran the coroutine returns it, and waits as co_yield does. It returns
+   the value of the co_resume_with that resumes it next, or NULL when
+   resumed by co_resume, co_loop or co_transfer. A wakeup from interrupt
+   that is pending does not make it return early: it still switches out so
+   the value is delivered, and co_loop resumes it.
+
+   co_resume_with resumes co as co_resume does, from the main context or,
+   with CO_NESTED_RESUME, a coroutine, and returns the value of co's next co_yield_value, or NULL if it yields
+   another way, sleeps or finishes. The value given to the first resume is
+   not delivered since the coroutine has not reached co_yield_value yet.
+
+   A producer can hand each buffer straight to its consumer:
+
+     // producer coroutine              // consumer, main context or coroutine
+     for (;;) {                         while ((buf = co_resume_with(&prod, NULL)) != NULL) {
+         fill(buf);                         consume(buf);
+         co_yield_value(buf);           }
+     }
+*/
+void *co_yield_value(void *value);
+void *co_resume_with(co_t *co, void *value);
+
 /* Sleep for a specified duration.
    Must be called from within a coroutine.
+
+   Sleepers are kept sorted by deadline, so co_loop only checks the first
+   one. Deadlines are compared with signed differences and survive the tick
+   wrapping around; a single sleep must stay below 2^31 ms.
 */
 void co_sleep(uint32_t ms);
 
@@ -79,5 +468,332 @@ void co_sleep(uint32_t ms);
 */
 void co_loop(void);
 
+/* Set the priority of a coroutine, below CO_PRIORITIES. The ready queue has
+   one FIFO per level: co_loop and co_yield_next always take the oldest
+   entry of the highest non-empty level, found in a bitmap (CLZ where the
+   CPU has it, a small table on the Cortex-M0+). Coroutines of one level
+   take turns; a high priority coroutine resumed from interrupt runs before
+   anything of a lower level still queued. The new priority applies from the
+   next time the coroutine becomes ready.
+*/
+void co_set_priority(co_t *co, uint32_t prio);
+
+/* Result of co_poll */
+typedef enum {
+    CO_POLL_READY,      // More work is pending now, call co_poll again
+    CO_POLL_DEADLINE,   // Nothing ready, next sleep deadline in *ticks
+    CO_POLL_IDLE        // Nothing ready nor sleeping, only an interrupt can create work
+} co_poll_t;
+
+/* Same as co_loop, then tells the caller how long it may block before
+   calling it again. ticks receives the same value as co_idle_time and may
+   be NULL.
+
+   Call it with interrupts enabled: the Cortex-M and RV32 context switches
+   enable them when they switch in, so a mask taken around co_poll would not
+   survive the first switch, and on RV32 a clear MIE reads as interrupt
+   context. To block without missing a co_resume from an interrupt, mask
+   interrupts after co_poll, check co_idle_time again and enter WFI with
+   them still masked (see LP_Idle in the example's lowpower.c). The host
+   port restores the signal mask it found instead, so there the signals
+   can stay blocked around co_poll and be unblocked atomically by pselect
+   or ppoll, as microco_host/main.c does.
+*/
+co_poll_t co_poll(uint32_t *ticks);
+
+#if CO_STACK_INFO
+/* Stack high-water mark of a coroutine in bytes, found by scanning the
+   paint from the bottom of its stack.
+
+   Without CO_STACK_PAINT only the 16 bottom words are painted, so the result
+   is exact only once the coroutine went that deep; otherwise it reports the
+   stack size minus 64 bytes.
+*/
+size_t co_stack_used(const co_t *co);
+
+/* Stack never used by a coroutine so far, stack size minus co_stack_used. */
+size_t co_stack_free(const co_t *co);
+
+typedef struct {
+    co_t   *co;
+    size_t  size;   /* stack size in bytes */
+    size_t  used;   /* high-water mark in bytes */
+} co_stack_info_t;
+
+/* Fill info with up to max entries, one per coroutine initialized with
+   co_init, most recent first. Finished coroutines leave the list until
+   co_reset. Returns the number of coroutines, which may be more than max.
+*/
+size_t co_stack_summary(co_stack_info_t *info, size_t max);
+#endif
+
+/* Returned by co_idle_time when no coroutine is sleeping */
+#define CO_IDLE_FOREVER 0xFFFFFFFFu
+
+/* Ticks the main context may stay idle before co_loop has work to do.
+   0 if a coroutine is ready or a sleep is due, CO_IDLE_FOREVER if no
+   coroutine is sleeping (only an interrupt can create work), otherwise the
+   time until the earliest sleep deadline.
+
+   For low power idle, call it with interrupts disabled and enter the low
+   power mode without enabling them in between. An interrupt that calls
+   co_resume after the check still wakes up the core from WFI.
+*/
+uint32_t co_idle_time(void);
+
 /* Get the currently running coroutine. */
 co_t * co_current(void);
+
+#if CO_CPU_STATS
+typedef struct {
+    uint64_t time;      /* total run time */
+    uint32_t runs;      /* times switched in */
+    uint32_t max;       /* longest single run */
+} co_cpu_stats_t;
+
+/* Copy the counters of co into stats, and clear them if reset is not 0.
+   NULL stands for the main context, which covers co_loop, tasks and idle
+   time. Only finished runs count, not the one in progress; resetting the
+   running context restarts its current run. The main context is counted
+   from the first context switch, what it did before is not known.
+   Interrupts count towards whoever they interrupt.
+*/
+void co_cpu_stats(co_t *co, co_cpu_stats_t *stats, int reset);
+
+/* Current value of the CPU time counter, to turn run times into shares of
+   the elapsed time. Wraps modulo 2^32.
+*/
+uint32_t co_cpu_now(void);
+#endif
+
+#if CO_TRACE
+/* Trace record types */
+typedef enum {
+    CO_TRACE_SWITCH,    // co switched in, the previous context out
+    CO_TRACE_WAIT,      // co waits to be resumed: yield, event, join, timed wait
+    CO_TRACE_SLEEP,     // co sleeps
+    CO_TRACE_WAKE,      // co made ready, arg 1 when from an interrupt
+    CO_TRACE_FINISH,    // co finished
+    CO_TRACE_TASK_RUN,  // task co starts running on the main stack
+    CO_TRACE_TASK_STOP, // task co reached a wait point or finished
+    CO_TRACE_LOST       // arg records overwritten before being drained, 255 for 255 or more
+} co_trace_event_t;
+
+/* One trace record, little-endian in memory on every port. time is raw:
+   ns on the host and mcycle on RV32, both wrapping modulo 2^32. On
+   Cortex-M it packs the tick count modulo 2^15 (bits 31-17), the SysTick
+   pending bit (bit 16) and SysTick->VAL (bits 15-0), so consecutive
+   records must be less than 32 s apart to be put back in sequence.
+*/
+typedef struct {
+    uint32_t time;      /* port timestamp, see above */
+    uint16_t co;        /* low 16 bits of the co_t or co_task_t address, 0 for main */
+    uint8_t  event;     /* co_trace_event_t */
+    uint8_t  arg;
+} co_trace_rec_t;
+
+/* Start tracing. A ring kept in CO_TRACE_SECTION across a reset is left as
+   it is, so its records can still be drained; otherwise it starts empty.
+*/
+void co_trace_init(void);
+
+/* Copy up to max records not drained yet, oldest first, and return how
+   many. Records overwritten since the last drain come out as one
+   CO_TRACE_LOST record. Send them as they are over a UART or a debugger;
+   microco_host/trace2json turns them into a Chrome trace that Perfetto
+   also opens.
+
+   A record is written with interrupts masked. On Cortex-M its timestamp
+   is a HAL_GetTick call and two register reads, packed with shifts; the
+   multiply and the fix-up of co_cpu_now are left to trace2json.
+*/
+size_t co_trace_drain(co_trace_rec_t *dst, size_t max);
+#endif
+
+/* Event: a flag set by co_event_signal and taken by co_event_wait, with at
+   most one waiter (typically a driver and the coroutine using it). 8 bytes,
+   zero-initialized or set up with co_event_init.
+
+   A signal that comes before the wait is kept: the wait takes it and
+   returns at once. Several signals before a wait count as one.
+*/
+typedef struct {
+    struct co_node_t *volatile waiter;  /* coroutine or task waiting */
+    volatile uint8_t  set;              /* signaled, not taken yet */
+} co_event_t;
+
+void co_event_init(co_event_t *ev);
+
+/* Wait until the event is set, then clear it. Must be called from within a
+   coroutine. While waiting, control goes directly to the next ready
+   coroutine if any, as with co_yield_next.
+*/
+void co_event_wait(co_event_t *ev);
+
+/* Same as co_event_wait, giving up after ms (CO_WAIT_FOREVER for no
+   timeout). The deadline is kept across resumes by anything else than the
+   signal.
+*/
+co_wait_t co_event_wait_timeout(co_event_t *ev, uint32_t ms);
+
+/* Set the event and make its waiter ready. Can be called from interrupt
+   handlers, coroutines, tasks and the main context. The waiter runs from
+   co_loop, or right away from a coroutine that yields with co_yield_next.
+*/
+void co_event_signal(co_event_t *ev);
+
+/* Byte channel: a ring buffer between one producer and one consumer, for
+   example a UART receive interrupt and the coroutine parsing the stream.
+
+   The producer only writes head and the consumer only writes tail, both
+   16-bit so stores are atomic on every port: no lock, no LDREX/STREX, no
+   interrupt masking. The capacity is a power of two so indices wrap with a
+   mask. The consumer blocks in co_chan_read on an empty channel; the
+   producer signals the event only when it makes the channel non-empty.
+*/
+typedef struct {
+    uint8_t          *buf;
+    uint16_t          mask;     /* capacity - 1 */
+    volatile uint16_t head;     /* next write, producer only */
+    volatile uint16_t tail;     /* next read, consumer only */
+    co_event_t        event;    /* consumer wakeup */
+} co_chan_t;
+
+/* size must be a power of two, up to 32768 */
+void co_chan_init(co_chan_t *ch, uint8_t *buf, size_t size);
+
+/* Producer side, from an interrupt handler or a coroutine. Returns 0 and
+   drops the byte if the channel is full. A few instructions, plus
+   co_event_signal when the channel was empty.
+*/
+static inline int co_chan_put(co_chan_t *ch, uint8_t byte) {
+    uint16_t head = ch->head;
+    if ((uint16_t)(head - ch->tail) > ch->mask) {
+        return 0;
+    }
+    ch->buf[head & ch->mask] = byte;
+    __atomic_signal_fence(__ATOMIC_RELEASE);    /* data before head */
+    ch->head = (uint16_t)(head + 1);
+    if (ch->tail == head) {
+        co_event_signal(&ch->event);
+    }
+    return 1;
+}
+
+/* Consumer side. co_chan_get takes one byte if there is one and returns 1,
+   co_chan_read waits until the channel is not empty, then takes up to len
+   bytes and returns how many. co_chan_read must be called from a
+   coroutine.
+*/
+int co_chan_get(co_chan_t *ch, uint8_t *byte);
+size_t co_chan_read(co_chan_t *ch, uint8_t *dst, size_t len);
+
+/* Same as co_chan_read, returns 0 if the channel stayed empty for ms */
+size_t co_chan_read_timeout(co_chan_t *ch, uint8_t *dst, size_t len, uint32_t ms);
+
+/* Bytes in the channel */
+static inline size_t co_chan_count(const co_chan_t *ch) {
+    return (uint16_t)(ch->head - ch->tail);
+}
+
+/* Stackless tasks
+ *
+ * For small state machines that do not need a stack of their own. A task
+ * is a function called again from the start each time it runs; the
+ * CO_TASK_* macros turn it into a resumable one (protothread style): the
+ * line it stopped at is kept in the task and jumped to on the next run.
+ *
+ * Tasks live in the same ready queue and sleep list as coroutines and run
+ * on the main stack from co_loop. Rules that come with it:
+ * - Local variables are lost at every CO_TASK_* wait point. Keep state in a
+ *   struct that embeds the co_task_t (the function gets a pointer to it).
+ * - The wait macros may only be used in the task function itself, not in
+ *   functions it calls, and not inside a switch statement.
+ *
+ *   typedef struct { co_task_t task; int count; } blinker_t;
+ *
+ *   static void blink(co_task_t *t) {
+ *       blinker_t *b = (blinker_t *)t;
+ *       CO_TASK_BEGIN(t);
+ *       for (b->count = 0; b->count < 10; ++b->count) {
+ *           HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
+ *           CO_TASK_SLEEP(t, 500);
+ *       }
+ *       CO_TASK_END(t);
+ *   }
+ */
+typedef struct co_task_t co_task_t;
+
+typedef void (*co_task_func)(co_task_t *task);
+
+struct co_task_t {
+    co_node_t    node;        /* scheduling state, must be first */
+    co_task_func fn;          /* task function */
+    uint16_t     lc;          /* line to continue from, 0 to start */
+};
+
+/* Initialize a task. It runs the first time it is resumed. */
+void co_task_init(co_task_t *task, co_task_func fn);
+
+/* Start or resume a task. From the main context it runs right away, until
+   its next wait point. From an interrupt handler or a coroutine it is
+   queued for co_loop, and a task that is running keeps the wakeup for its
+   next CO_TASK_YIELD, as coroutines do.
+
+   A task may resume coroutines with co_resume: they run right away, on
+   their own stack.
+*/
+void co_task_resume(co_task_t *task);
+
+/* Same as co_set_priority, for a task */
+void co_task_set_priority(co_task_t *task, uint32_t prio);
+
+/* Current status of a task */
+static inline co_status_t co_task_status(const co_task_t *task) {
+    return (co_status_t)task->node.status;
+}
+
+/* Used by the CO_TASK_* macros. co_task_wait returns 0 if the task was
+   already resumed from interrupt meanwhile and goes on running.
+*/
+int co_task_wait(co_task_t *task);
+void co_task_sleep(co_task_t *task, uint32_t ms);
+int co_task_event_wait(co_task_t *task, co_event_t *ev);
+
+#if defined(__GNUC__) && (__GNUC__ >= 7)
+#define CO_TASK_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define CO_TASK_FALLTHROUGH ((void)0)
+#endif
+
+#define CO_TASK_BEGIN(t)    switch ((t)->lc) { case 0:
+
+/* Wait to be resumed, same as co_yield */
+#define CO_TASK_YIELD(t) \
+    do { (t)->lc = __LINE__; if (co_task_wait(t)) return; CO_TASK_FALLTHROUGH; case __LINE__:; } while (0)
+
+/* Same as co_sleep */
+#define CO_TASK_SLEEP(t, ms) \
+    do { (t)->lc = __LINE__; co_task_sleep((t), (ms)); return; case __LINE__:; } while (0)
+
+/* Check cond once per co_loop call until it is true. co_idle_time reports
+   no idle time meanwhile, prefer a wakeup with co_task_resume.
+*/
+#define CO_TASK_WAIT_UNTIL(t, cond) \
+    do { while (!(cond)) { CO_TASK_SLEEP((t), 0); } } while (0)
+
+/* Same as co_event_wait */
+#define CO_TASK_WAIT_EVENT(t, ev) \
+    do { (t)->lc = __LINE__; CO_TASK_FALLTHROUGH; case __LINE__: if (co_task_event_wait((t), (ev))) return; } while (0)
+
+/* The task finishes here, returning from the function also finishes it */
+#define CO_TASK_END(t)      } (t)->lc = 0
+
+#if defined(__x86_64__) || defined(__aarch64__)
+/* Host port only. There are no interrupts on the host, so code that plays the
+   role of an interrupt handler (a signal handler, a test) brackets itself with
+   these calls. co_resume in between behaves as if called from an ISR.
+*/
+void co_host_isr_enter(void);
+void co_host_isr_exit(void);
+#endif
@@ -0,0 +1,243 @@
+/*
+ * bench.c - Scheduler micro-benchmarks
+ *
+ * - resume_yield:  co_resume + co_yield from the main context, two context
+ *                  switches per operation.
+ * - loop_resume:   a coroutine does co_sleep(0) and co_loop resumes it,
+ *                  the co_yield -> co_loop -> resume path.
+ * - isr_resume:    from before an interrupt that calls co_resume until the
+ *                  coroutine runs again from the following co_loop.
+ * - loop_idle:     co_loop with n coroutines waiting and nothing to do.
+ * - sleep_insert:  co_sleep of a coroutine among n - 1 sleepers with
+ *                  earlier or equal deadlines, so the sorted insert walks
+ *                  the whole list. Timed as resuming a sleeper that sleeps
+ *                  again, minus the same resumes of coroutines that yield:
+ *                  co_init, the resume and the context switches cancel
+ *                  out. What is left also takes the sleeper off the head
+ *                  of the list, which does not depend on n.
+ * - loop_sleeping: co_loop with n coroutines sleeping, none due.
+ * - loop_ready:    co_loop running n coroutines made ready from an
+ *                  interrupt, per coroutine run.
+ *
+ * Benchmark coroutines loop until g_stop is set, then finish, so every
+ * measurement starts with fresh co_t.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "microco.h"
+#include "bench.h"
+
+#define BENCH_LONG_SLEEP 0x40000000u
+
+static co_t    g_co[BENCH_MAX_CO];
+static uint8_t g_stack[BENCH_MAX_CO][BENCH_STACK] __attribute__((aligned(16)));
+
+static volatile int      g_stop = 0;
+static volatile uint32_t g_isr_count = 0;    // coroutines bench_isr resumes
+static volatile uint32_t g_run_time;         // bench_now when the coroutine last ran
+
+static void print_u32(uint32_t v) {
+    char buf[11];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = (char)('0' + (v % 10));
+        v /= 10;
+    } while (v);
+    bench_print(&buf[i]);
+}
+
+/* total / ops with two decimals, without floating point */
+static void report(const char *bench, uint32_t n, uint32_t ops, uint32_t total) {
+    uint64_t hundredths = ((uint64_t)total * 100u + ops / 2) / ops;
+
+    bench_print("{\"target\":\"" BENCH_TARGET "\",\"bench\":\"");
+    bench_print(bench);
+    bench_print("\",\"n\":");
+    print_u32(n);
+    bench_print(",\"ops\":");
+    print_u32(ops);
+    bench_print(",\"per_op\":");
+    print_u32((uint32_t)(hundredths / 100u));
+    bench_print(".");
+    uint32_t frac = (uint32_t)(hundredths % 100u);
+    if (frac < 10) {
+        bench_print("0");
+    }
+    print_u32(frac);
+    bench_print(",\"unit\":\"" BENCH_UNIT "\"}\n");
+}
+
+static void yielder(void) {
+    while (!g_stop) {
+        co_yield();
+    }
+}
+
+static void zero_sleeper(void) {
+    while (!g_stop) {
+        co_sleep(0);
+    }
+}
+
+static void long_sleeper(void) {
+    while (!g_stop) {
+        co_sleep(BENCH_LONG_SLEEP);
+    }
+}
+
+static void timed_yielder(void) {
+    while (!g_stop) {
+        co_yield();
+        g_run_time = bench_now();
+    }
+}
+
+/* Initialize n coroutines and run each up to its first wait */
+static void start(uint32_t n, co_func fn) {
+    for (uint32_t i = 0; i < n; ++i) {
+        co_init(&g_co[i], g_stack[i], sizeof(g_stack[i]), fn);
+        co_resume(&g_co[i]);
+    }
+}
+
+/* Let the n coroutines finish, whatever they wait for */
+static void stop(uint32_t n) {
+    g_stop = 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        while (co_status(&g_co[i]) != CO_STATUS_FINISHED) {
+            co_resume(&g_co[i]);
+        }
+    }
+    g_stop = 0;
+}
+
+void bench_isr(void) {
+    for (uint32_t i = 0; i < g_isr_count; ++i) {
+        co_resume(&g_co[i]);
+    }
+}
+
+static void bench_resume_yield(void) {
+    const uint32_t ops = BENCH_OPS;
+    start(1, yielder);
+    uint32_t t0 = bench_now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        co_resume(&g_co[0]);
+    }
+    report("resume_yield", 1, ops, bench_now() - t0);
+    stop(1);
+}
+
+static void bench_loop_resume(void) {
+    const uint32_t ops = BENCH_OPS;
+    start(1, zero_sleeper);
+    uint32_t t0 = bench_now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        co_loop();
+    }
+    report("loop_resume", 1, ops, bench_now() - t0);
+    stop(1);
+}
+
+/* Resume the n coroutines in turn, rounds times, and return how long it took */
+static uint32_t resume_all(uint32_t n, uint32_t rounds) {
+    uint32_t t0 = bench_now();
+    for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t i = 0; i < n; ++i) {
+            co_resume(&g_co[i]);
+        }
+    }
+    return bench_now() - t0;
+}
+
+static void bench_isr_resume(void) {
+    const uint32_t ops = BENCH_OPS;
+    uint32_t total = 0;
+    start(1, timed_yielder);
+    g_isr_count = 1;
+    for (uint32_t i = 0; i < ops; ++i) {
+        uint32_t t0 = bench_now();
+        bench_isr_pend();
+        co_loop();
+        total += g_run_time - t0;
+    }
+    g_isr_count = 0;
+    report("isr_resume", 1, ops, total);
+    stop(1);
+}
+
+static void bench_loop_idle(uint32_t n) {
+    const uint32_t ops = BENCH_OPS;
+    start(n, yielder);
+    uint32_t t0 = bench_now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        co_loop();
+    }
+    report("loop_idle", n, ops, bench_now() - t0);
+    stop(n);
+}
+
+static void bench_sleeping(uint32_t n) {
+    const uint32_t ops = BENCH_OPS;
+
+    // Each insert walks n sleepers, keep the total walk near BENCH_OPS
+    uint32_t rounds = BENCH_OPS / n / n;
+    if (rounds == 0) {
+        rounds = 1;
+    }
+    start(n, yielder);
+    uint32_t base = resume_all(n, rounds);
+    stop(n);
+
+    // Resumed in deadline order, each sleeper leaves the head of the list
+    // and goes back to its tail
+    start(n, long_sleeper);
+    uint32_t total = resume_all(n, rounds);
+    report("sleep_insert", n, rounds * n, (total > base) ? (total - base) : 0);
+
+    uint32_t t0 = bench_now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        co_loop();
+    }
+    report("loop_sleeping", n, ops, bench_now() - t0);
+    stop(n);
+}
+
+static void bench_loop_ready(uint32_t n) {
+    uint32_t rounds = BENCH_OPS / n;
+    uint32_t total  = 0;
+    if (rounds == 0) {
+        rounds = 1;
+    }
+    start(n, yielder);
+    g_isr_count = n;
+    for (uint32_t r = 0; r < rounds; ++r) {
+        bench_isr_pend();
+        uint32_t t0 = bench_now();
+        co_loop();
+        total += bench_now() - t0;
+    }
+    g_isr_count = 0;
+    report("loop_ready", n, rounds * n, total);
+    stop(n);
+}
+
+void bench_run(void) {
+    bench_resume_yield();
+    bench_loop_resume();
+    bench_isr_resume();
+
+    for (uint32_t n = 1; ; n *= 10) {
+        if (n > BENCH_MAX_CO) {
+            n = BENCH_MAX_CO;
+        }
+        bench_loop_idle(n);
+        bench_sleeping(n);
+        bench_loop_ready(n);
+        if (n == BENCH_MAX_CO) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * bench.h - Scheduler micro-benchmarks, shared by the host and QEMU builds
+ *
+ * bench.c holds the benchmarks, the platform file (microco_host/bench_host.c,
+ * microco_qemu/cortexm/bench_cortexm.c) provides a time source, an output
+ * and a way to run code in interrupt context. Results are printed as one
+ * JSON object per line:
+ *
+ *   {"target":"host","bench":"resume_yield","n":1,"ops":1000000,"per_op":38.21,"unit":"ns"}
+ *
+ * n is the number of coroutines involved, per_op the average time of one
+ * operation (see bench.c for what an operation is in each benchmark).
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* Name put in every result line */
+#ifndef BENCH_TARGET
+#define BENCH_TARGET "host"
+#endif
+
+/* Unit of bench_now */
+#ifndef BENCH_UNIT
+#define BENCH_UNIT "ns"
+#endif
+
+/* Most coroutines in the scaling benchmarks. They run with 1, 10, 100...
+   coroutines up to this count, and this count itself.
+*/
+#ifndef BENCH_MAX_CO
+#define BENCH_MAX_CO 32
+#endif
+
+/* Stack of each benchmark coroutine, in bytes */
+#ifndef BENCH_STACK
+#define BENCH_STACK 192
+#endif
+
+/* Operations per measurement, divided among the coroutines when a
+   benchmark scales */
+#ifndef BENCH_OPS
+#define BENCH_OPS 2000
+#endif
+
+/* Platform: free-running counter in BENCH_UNIT, wrapping modulo 2^32 */
+uint32_t bench_now(void);
+
+/* Platform: write a string */
+void bench_print(const char *s);
+
+/* Platform: call bench_isr from interrupt context, return once it ran */
+void bench_isr_pend(void);
+
+/* Run from interrupt context by bench_isr_pend */
+void bench_isr(void);
+
+/* Run every benchmark and print the results */
+void bench_run(void);
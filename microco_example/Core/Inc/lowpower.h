@@ -0,0 +1,26 @@
+/*
+ * lowpower.h - Tickless idle for the microco example
+ *
+ * Call LP_Idle after co_loop in the main loop. When no coroutine is ready it
+ * sleeps until the earliest co_sleep deadline or the next interrupt:
+ * - STOP mode with LPTIM1 as wakeup timer when the deadline is far enough
+ *   and no peripheral needs its clock (the caller tells with allowStop).
+ *   SysTick is suspended and the HAL tick is corrected on wakeup.
+ * - Sleep mode (WFI) otherwise, SysTick keeps running.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Start LSI and configure LPTIM1 as a one-shot wakeup timer. */
+void LP_Init(void);
+
+/* Idle until there is work for co_loop. allowStop must be false while a
+   peripheral clocked from the APB (UART transfer in progress) has to keep
+   running.
+*/
+void LP_Idle(bool allowStop);
+
+/* Fraction of time spent in LP_Idle since the previous call, in per mille. */
+uint32_t LP_IdlePermille(void);
@@ -0,0 +1,156 @@
+/*
+ * lowpower.c - Tickless idle for the microco example
+ *
+ * LPTIM1 runs from LSI (37 kHz nominal) divided by 32, about 1.16 kHz, so a
+ * STOP period can last up to 56 s. LSI is only accurate to about 10 %, which
+ * is the error of the HAL tick correction after STOP.
+ */
+#include "main.h"
+#include "lowpower.h"
+#include "microco.h"
+
+#define LP_LSI_HZ       37000u
+#define LP_LPTIM_HZ     (LP_LSI_HZ / 32u)
+#define LP_LPTIM_MAX    0xFFFFu
+
+/* Below this, STOP entry and clock restore cost more than they save */
+#define LP_STOP_MIN_MS  5u
+
+extern __IO uint32_t uwTick;
+void SystemClock_Config(void);
+
+static uint64_t lp_idle_cycles = 0;
+static uint32_t lp_window_start = 0;
+
+void LP_Init(void)
+{
+    RCC->CSR |= RCC_CSR_LSION;
+    while ((RCC->CSR & RCC_CSR_LSIRDY) == 0) {
+    }
+
+    // LPTIM1 clocked from LSI, kept running in STOP
+    RCC->CCIPR = (RCC->CCIPR & ~RCC_CCIPR_LPTIM1SEL) | RCC_CCIPR_LPTIM1SEL_0;
+    RCC->APB1ENR |= RCC_APB1ENR_LPTIM1EN;
+
+    // CFGR and IER can only be written while disabled
+    LPTIM1->CR = 0;
+    LPTIM1->CFGR = LPTIM_CFGR_PRESC_2 | LPTIM_CFGR_PRESC_0; // /32
+    LPTIM1->IER = LPTIM_IER_ARRMIE;
+
+    // LPTIM1 wakes up from STOP through EXTI line 29
+    EXTI->IMR |= EXTI_IMR_IM29;
+    HAL_NVIC_SetPriority(LPTIM1_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(LPTIM1_IRQn);
+
+    // Wake up from STOP on HSI16, the clock USART2 receives with
+    RCC->CFGR |= RCC_CFGR_STOPWUCK;
+
+    lp_window_start = HAL_GetTick();
+}
+
+void LPTIM1_IRQHandler(void)
+{
+    LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+}
+
+/* LPTIM counts on an asynchronous clock, read until two reads agree */
+static uint32_t LP_ReadCounter(void)
+{
+    uint32_t a, b;
+    do {
+        a = LPTIM1->CNT;
+        b = LPTIM1->CNT;
+    } while (a != b);
+    return a;
+}
+
+/* Called with interrupts disabled, returns with them disabled */
+static void LP_Stop(uint32_t ms)
+{
+    uint32_t counts = LP_LPTIM_MAX;
+    if (ms < (LP_LPTIM_MAX * 1000u) / LP_LPTIM_HZ) {
+        counts = (ms * LP_LPTIM_HZ) / 1000u;
+    }
+
+    LPTIM1->ICR = LPTIM_ICR_ARRMCF | LPTIM_ICR_ARROKCF;
+    LPTIM1->CR = LPTIM_CR_ENABLE;
+    LPTIM1->ARR = counts;
+    while ((LPTIM1->ISR & LPTIM_ISR_ARROK) == 0) {
+    }
+    LPTIM1->CR |= LPTIM_CR_SNGSTRT;
+
+    HAL_SuspendTick();
+    HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+
+    // Woken up by LPTIM1 or by any other interrupt, which runs once the
+    // caller enables interrupts again. STOP falls back to HSI16, restore PLL.
+    SystemClock_Config();
+
+    uint32_t elapsed = counts;
+    if ((LPTIM1->ISR & LPTIM_ISR_ARRM) == 0) {
+        elapsed = LP_ReadCounter();
+    }
+    LPTIM1->CR = 0;
+
+    uint32_t elapsed_ms = (elapsed * 1000u) / LP_LPTIM_HZ;
+    uwTick += elapsed_ms;
+    HAL_ResumeTick();
+
+    lp_idle_cycles += (uint64_t)elapsed_ms * (SystemCoreClock / 1000u);
+}
+
+/* Called with interrupts disabled, returns with them disabled */
+static void LP_Sleep(void)
+{
+    uint32_t load = SysTick->LOAD + 1u;
+    (void)SysTick->CTRL; // clear COUNTFLAG
+    uint32_t before = SysTick->VAL;
+
+    HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+
+    // SysTick wakes us up at the latest when it reaches zero, so it wrapped
+    // at most once
+    uint32_t after = SysTick->VAL;
+    if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) {
+        lp_idle_cycles += before + (load - after);
+    }
+    else {
+        lp_idle_cycles += before - after;
+    }
+}
+
+void LP_Idle(bool allowStop)
+{
+    __disable_irq();
+
+    // Checked with interrupts disabled: a co_resume from an interrupt after
+    // this point leaves the interrupt pending, which ends WFI immediately
+    uint32_t idle = co_idle_time();
+    if (idle != 0) {
+        if (allowStop && (idle >= LP_STOP_MIN_MS)) {
+            LP_Stop(idle);
+        }
+        else {
+            LP_Sleep();
+        }
+    }
+
+    __enable_irq();
+}
+
+uint32_t LP_IdlePermille(void)
+{
+    uint32_t now = HAL_GetTick();
+    uint64_t total = (uint64_t)(now - lp_window_start) * (SystemCoreClock / 1000u);
+    uint32_t permille = 0;
+
+    __disable_irq();
+    if (total != 0) {
+        permille = (uint32_t)((lp_idle_cycles * 1000u) / total);
+    }
+    lp_idle_cycles = 0;
+    lp_window_start = now;
+    __enable_irq();
+
+    return (permille > 1000u) ? 1000u : permille;
+}
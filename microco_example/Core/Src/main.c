@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "microco.h"
+#include "lowpower.h"
 
 /* USER CODE END Includes */
 
@@ -64,27 +65,25 @@ static void MX_LPUART1_UART_Init(void);
 /* USER CODE BEGIN 0 */
 
 typedef struct {
-    co_t    * toResume; // Coroutine to resume after sending is done
+    co_event_t done;    // Signaled when sending is done
     bool    isBusy;     // Indicates if a send operation is already in progress
 } ToSend;
 
-typedef struct {
-    uint32_t timeout;
-    co_t    * toResume; // Coroutine to resume after receiving is done
-    bool    isBusy;     // Indicates if a receive operation is already in progress
-} ToReceive;
-
 ToSend toSendUart2 = {0,};
 ToSend toSendLpuart1 = {0,};
-ToReceive toReceiveUart2 = {0,};
+
+// USART2 reception is always armed for one byte, the callback moves it to
+// the channel and re-arms, so no byte is lost between reads
+static uint8_t   rxByteUart2;
+static uint8_t   rxBufUart2[64];
+static co_chan_t rxUart2;
 
 static uint8_t BSP_UART_Send(uint8_t * buffer, size_t len) {
     if (!toSendUart2.isBusy) {
         toSendUart2.isBusy = true;
-        toSendUart2.toResume = co_current();
 
         HAL_UART_Transmit_IT(&huart2, buffer, len);
-        co_yield();
+        co_event_wait(&toSendUart2.done);
         return 0;
     }
     else {
@@ -92,29 +91,22 @@ static uint8_t BSP_UART_Send(uint8_t * buffer, size_t len) {
     }
 }
 
-static uint8_t BSP_UART_Receive(uint8_t * buffer, size_t len, uint32_t timeout) {
-    if (!toReceiveUart2.isBusy) {
-        toReceiveUart2.isBusy = true;
-        toReceiveUart2.timeout = timeout;
-        toReceiveUart2.toResume = co_current();
+static void BSP_UART_StartReceive(void) {
+    co_chan_init(&rxUart2, rxBufUart2, sizeof(rxBufUart2));
+    HAL_UART_Receive_IT(&huart2, &rxByteUart2, 1);
+}
 
-        HAL_UART_Receive_IT(&huart2, buffer, len);
-        co_yield();
-        return 0;
-    }
-    else {
-        // Busy
-        return 1;
-    }
+// Wait up to timeout ms for at least one byte, returns how many were copied to buffer
+static size_t BSP_UART_Receive(uint8_t * buffer, size_t len, uint32_t timeout) {
+    return co_chan_read_timeout(&rxUart2, buffer, len, timeout);
 }
 
 static uint8_t BSP_LPUART_Send(uint8_t * buffer, size_t len) {
     if (!toSendLpuart1.isBusy) {
         toSendLpuart1.isBusy = true;
-        toSendLpuart1.toResume = co_current();
 
         HAL_UART_Transmit_IT(&hlpuart1, buffer, len);
-        co_yield();
+        co_event_wait(&toSendLpuart1.done);
         return 0;
     }
     else {
@@ -132,7 +124,14 @@ static uint8_t stack2[128] __attribute__((aligned(8)));
 
 static void worker1() {
     for (int i = 0; i < 500; ++i) {
-        BSP_LPUART_Send((uint8_t *)"worker1\n", 8);
+        // Report the idle fraction of the last second, "idle 0987\n"
+        static uint8_t report[] = "idle 0000\n";
+        uint32_t permille = LP_IdlePermille();
+        for (int d = 8; d >= 5; --d) {
+            report[d] = '0' + (permille % 10);
+            permille /= 10;
+        }
+        BSP_LPUART_Send(report, sizeof(report) - 1);
         co_sleep(1000);
     }
 }
@@ -140,8 +139,10 @@ static void worker1() {
 static void worker2() {
     for (int i = 0; i < 500; ++i) {
         static uint8_t buffer[8];
-        BSP_UART_Receive(buffer, sizeof(buffer), 1000);
-        BSP_UART_Send(buffer, sizeof(buffer));
+        size_t len = BSP_UART_Receive(buffer, sizeof(buffer), 1000);
+        if (len > 0) {
+            BSP_UART_Send(buffer, len);
+        }
     }
 }
 
@@ -185,6 +186,9 @@ int main(void)
 
     }
 
+    LP_Init();
+    BSP_UART_StartReceive();
+
     co_init(&co1, stack1, sizeof(stack1), worker1);
     co_init(&co2, stack2, sizeof(stack2), worker2);
 
@@ -202,6 +206,11 @@ int main(void)
     // Loop iteration to allow for features like sleep or resume from interrupt
     co_loop();
 
+    // Sleep until the next deadline or interrupt. STOP stops PCLK1, which
+    // clocks LPUART1, so it is only allowed while no transmission is in
+    // progress. USART2 runs from HSI16 and wakes up from STOP on reception.
+    LP_Idle(!toSendUart2.isBusy && !toSendLpuart1.isBusy);
+
     /* USER CODE BEGIN 3 */
   }
   /* USER CODE END 3 */
@@ -250,7 +259,7 @@ void SystemClock_Config(void)
     Error_Handler();
   }
   PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USART2|RCC_PERIPHCLK_LPUART1;
-  PeriphClkInit.Usart2ClockSelection = RCC_USART2CLKSOURCE_PCLK1;
+  PeriphClkInit.Usart2ClockSelection = RCC_USART2CLKSOURCE_HSI;
   PeriphClkInit.Lpuart1ClockSelection = RCC_LPUART1CLKSOURCE_PCLK1;
   if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK)
   {
@@ -323,6 +332,18 @@ static void MX_USART2_UART_Init(void)
   }
   /* USER CODE BEGIN USART2_Init 2 */
 
+  // Keep reception working in STOP: with UESM set, USART2 turns HSI16 on by
+  // itself when a start bit arrives and wakes the MCU up through EXTI line 26
+  // once the byte is received
+  UART_WakeUpTypeDef wakeUp = {0};
+  wakeUp.WakeUpEvent = UART_WAKEUP_ON_READDATA_NONEMPTY;
+  if (HAL_UARTEx_StopModeWakeUpSourceConfig(&huart2, wakeUp) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  HAL_UARTEx_EnableStopMode(&huart2);
+  EXTI->IMR |= EXTI_IMR_IM26;
+
   /* USER CODE END USART2_Init 2 */
 
 }
@@ -354,14 +375,9 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 	}
 	else if (huart == &huart2)
 	{
-		if (toReceiveUart2.isBusy)
-		{
-			toReceiveUart2.isBusy = false;
-			if (toReceiveUart2.toResume != NULL)
-			{
-				co_resume(toReceiveUart2.toResume);
-			}
-		}
+		// Bytes arriving while the channel is full are dropped
+		co_chan_put(&rxUart2, rxByteUart2);
+		HAL_UART_Receive_IT(&huart2, &rxByteUart2, 1);
 	}
 }
 
@@ -372,10 +388,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
         if (toSendLpuart1.isBusy)
         {
         	toSendLpuart1.isBusy = false;
-            if (toSendLpuart1.toResume != NULL)
-        	{
-        		co_resume(toSendLpuart1.toResume);
-        	}
+        	co_event_signal(&toSendLpuart1.done);
         }
     }
     else if (huart == &huart2)
@@ -383,10 +396,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 		if (toSendUart2.isBusy)
         {
             toSendUart2.isBusy = false;
-            if (toSendUart2.toResume != NULL)
-            {
-                co_resume(toSendUart2.toResume);
-            }
+            co_event_signal(&toSendUart2.done);
         }
 	}
 }
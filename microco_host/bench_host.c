@@ -0,0 +1,37 @@
+/*
+ * bench_host.c - Host platform of the scheduler benchmarks (microco_bench)
+ *
+ * CLOCK_MONOTONIC in ns as time source. The "interrupt" is a plain call
+ * bracketed with co_host_isr_enter/exit. Built with CO_HOST_NO_SIGNALS, as
+ * bench_shared, so interrupt masking costs nothing and the numbers show the
+ * scheduler alone.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "microco.h"
+#include "bench.h"
+
+uint32_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+}
+
+void bench_print(const char *s) {
+    fputs(s, stdout);
+}
+
+void bench_isr_pend(void) {
+    co_host_isr_enter();
+    bench_isr();
+    co_host_isr_exit();
+}
+
+int main(void) {
+    bench_run();
+    return 0;
+}
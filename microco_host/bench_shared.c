@@ -0,0 +1,92 @@
+/*
+ * bench_shared.c - Copy cost of CO_SHARED_STACK against the RAM it saves
+ *
+ * Two coroutines that each hold a frame of DEPTH bytes are resumed in turn,
+ * first on private stacks, then on one shared stack, where every resume
+ * swaps the two stacks. The difference per resume is the copy cost. The
+ * shared stack layout needs one stack plus one save buffer per coroutine
+ * sized for what it holds at co_yield, instead of one worst-case stack per
+ * coroutine.
+ *
+ * Built with CO_HOST_NO_SIGNALS, so interrupt masking costs nothing and the
+ * numbers show the scheduler alone.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "microco.h"
+
+#define ROUNDS      200000
+#define STACK_SIZE  16384
+#define SAVE_SIZE   4096
+#define N_CO        2
+
+static uint8_t stacks[N_CO][STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t shared[STACK_SIZE] __attribute__((aligned(16)));
+static uint32_t saves[N_CO][SAVE_SIZE / 4];
+
+static const size_t depths[] = { 0, 64, 256, 1024 };
+#define N_DEPTH (sizeof(depths) / sizeof(depths[0]))
+
+// A co_t is initialized once, so one set per run
+static co_t    cos_private[N_DEPTH][N_CO];
+static co_t    cos_shared[N_DEPTH][N_CO];
+static size_t  depth;
+
+static void worker(void) {
+    volatile uint8_t frame[depth + 1];
+    frame[0] = 1;
+    for (;;) {
+        co_yield();
+        frame[depth] = frame[0];
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// ns per co_resume + co_yield pair, both coroutines resumed in turn
+static double run(co_t *cos) {
+    for (int i = 0; i < N_CO; ++i) {
+        co_resume(&cos[i]);
+    }
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < N_CO; ++i) {
+            co_resume(&cos[i]);
+        }
+    }
+    return (double)(now_ns() - t0) / (ROUNDS * N_CO);
+}
+
+int main(void) {
+    printf("depth  saved  private_ns  shared_ns  copy_ns  private_ram  shared_ram\n");
+    for (size_t d = 0; d < N_DEPTH; ++d) {
+        depth = depths[d];
+
+        for (int i = 0; i < N_CO; ++i) {
+            co_init(&cos_private[d][i], stacks[i], STACK_SIZE, worker);
+        }
+        double t_private = run(cos_private[d]);
+
+        co_shared_stack(shared, sizeof(shared));
+        for (int i = 0; i < N_CO; ++i) {
+            co_init_shared(&cos_shared[d][i], saves[i], SAVE_SIZE, worker);
+        }
+        double t_shared = run(cos_shared[d]);
+
+        // RAM for N_CO coroutines that need STACK_SIZE at worst, save
+        // buffers sized for what they hold at co_yield
+        uint32_t saved = cos_shared[d][0].saved;
+        printf("%5zu  %5u  %10.1f  %9.1f  %7.1f  %11u  %10u\n",
+               depth, (unsigned)saved, t_private, t_shared, t_shared - t_private,
+               (unsigned)(N_CO * STACK_SIZE), (unsigned)(STACK_SIZE + N_CO * saved));
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * check.c - Host regression checks for scheduler races and misuse
+ *
+ *   make check
+ *
+ * Each check prints one line and the program exits with 1 if any failed.
+ * Interrupts are played by a SIGALRM timer firing every 50 us while the main
+ * context and the coroutines run, so the races are hit at random points
+ * instead of at the few places a synchronous test could reach.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "microco.h"
+
+#define CHECK_SIGNALS 20000u    // timer interrupts per check
+
+static co_t    co_a;
+static co_t    co_b;
+static uint8_t stack_a[16384] __attribute__((aligned(16)));
+static uint8_t stack_b[16384] __attribute__((aligned(16)));
+
+static volatile uint32_t g_alarms = 0;
+static co_event_t        g_event;
+
+static void on_alarm(int sig) {
+    (void)sig;
+    co_host_isr_enter();
+    co_event_signal(&g_event);
+    co_host_isr_exit();
+    ++g_alarms;
+}
+
+static void alarm_start(void) {
+    struct sigaction sa = {0};
+    sa.sa_handler = on_alarm;
+    sigaction(SIGALRM, &sa, NULL);
+
+    struct itimerval it = {{0, 50}, {0, 50}};
+    g_alarms = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static void alarm_stop(void) {
+    struct itimerval it = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* A signal that reaches a waiter resumed by something else, before it
+   checks the event again, must not leave a wakeup behind: the co_yield
+   after the wait only returns when the main context resumes it.
+*/
+static volatile int      g_resumed;     // set by main right before co_resume
+static volatile uint32_t g_spurious;
+static volatile int      g_stop;
+
+static void event_waiter(void) {
+    while (!g_stop) {
+        co_event_wait(&g_event);
+        g_resumed = 0;
+        co_yield();
+        if (!g_resumed && !g_stop) {
+            ++g_spurious;
+        }
+    }
+}
+
+static int check_event_wake(void) {
+    co_event_init(&g_event);
+    g_stop = 0;
+    g_spurious = 0;
+    co_init(&co_a, stack_a, sizeof(stack_a), event_waiter);
+
+    alarm_start();
+    while (g_alarms < CHECK_SIGNALS) {
+        // Resumed while waiting for the event, it goes back to waiting
+        g_resumed = 1;
+        co_resume(&co_a);
+        co_loop();
+    }
+    alarm_stop();
+
+    g_stop = 1;
+    while (co_status(&co_a) != CO_STATUS_FINISHED) {
+        g_resumed = 1;
+        co_resume(&co_a);
+    }
+
+    printf("%s event_wake: %u spurious returns from co_yield\n",
+           g_spurious ? "FAIL" : "ok  ", (unsigned)g_spurious);
+    return g_spurious == 0;
+}
+
+/* co_init must not trust what the co_t held before: zeroes, garbage, or a
+   copy of a registered coroutine. Each is registered exactly once, also
+   when initialized twice before running, and leaves the list when done.
+*/
+static uint32_t g_runs;
+
+static void counter(void) {
+    ++g_runs;
+}
+
+static size_t listed(void) {
+    return co_stack_summary(NULL, 0);
+}
+
+static int check_init_garbage(void) {
+    static const int fill[] = { 0x00, 0xA5, 0xFF, -1 };
+    int ok = 1;
+    g_runs = 0;
+    size_t base = listed();
+
+    co_init(&co_a, stack_a, sizeof(stack_a), counter);
+    for (unsigned i = 0; i < sizeof(fill) / sizeof(fill[0]); ++i) {
+        if (fill[i] < 0) {
+            memcpy(&co_b, &co_a, sizeof(co_b));     // co_a's key and links
+        }
+        else {
+            memset(&co_b, fill[i], sizeof(co_b));
+        }
+        co_init(&co_b, stack_b, sizeof(stack_b), counter);
+        co_init(&co_b, stack_b, sizeof(stack_b), counter);
+        ok &= (listed() == base + 2);
+        co_resume(&co_b);
+        ok &= (co_status(&co_b) == CO_STATUS_FINISHED) && (listed() == base + 1);
+    }
+    co_resume(&co_a);
+    ok &= (listed() == base) && (g_runs == 5);
+
+    printf("%s init_garbage: %u runs, %u listed\n",
+           ok ? "ok  " : "FAIL", (unsigned)g_runs, (unsigned)(listed() - base));
+    return ok;
+}
+
+int main(void) {
+    int ok = 1;
+    ok &= check_event_wake();
+    ok &= check_init_garbage();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/*
+ * main.c - Host version of microco_example
+ *
+ * Same two workers as the STM32 example, built natively on Linux. The UART
+ * is replaced by stdout and the receive interrupt by a SIGALRM timer whose
+ * handler puts bytes into worker2's channel exactly like
+ * HAL_UART_RxCpltCallback does.
+ *
+ * Instead of spinning on co_loop, the main loop blocks in pselect for as long
+ * as co_poll allows, with SIGALRM unmasked only while blocked.
+ *
+ * Built with CO_TRACE (make trace), the main loop drains the scheduler trace
+ * into trace.bin the way firmware would send it over a UART.
+ *
+ * Built with CO_CPU_STATS (make cpu), it prints the CPU time of each context
+ * at the end and fails if one exceeds the wall time of the run.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "microco.h"
+
+static co_t co1;
+static co_t co2;
+
+static uint8_t stack1[16384] __attribute__((aligned(16)));
+static uint8_t stack2[16384] __attribute__((aligned(16)));
+
+static uint8_t   rx_buf[64];
+static co_chan_t rx;
+
+#if CO_TRACE
+static FILE *trace_out;
+
+static void trace_drain(void) {
+    co_trace_rec_t rec[32];
+    size_t n;
+    while ((n = co_trace_drain(rec, 32)) > 0) {
+        fwrite(rec, sizeof(rec[0]), n, trace_out);
+    }
+}
+#endif
+
+#if CO_CPU_STATS
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Host CPU time is in nanoseconds too, no context ran longer than the run
+static int cpu_report(uint64_t elapsed) {
+    static const char *const names[] = { "main", "worker1", "worker2" };
+    co_t *const cos[] = { NULL, &co1, &co2 };
+    int ok = 1;
+    for (int i = 0; i < 3; ++i) {
+        co_cpu_stats_t stats;
+        co_cpu_stats(cos[i], &stats, 0);
+        printf("%-8s time %llu ns, %u runs, max %u ns\n", names[i],
+               (unsigned long long)stats.time, (unsigned)stats.runs, (unsigned)stats.max);
+        if ((stats.time > elapsed) || (stats.max > elapsed)) {
+            fprintf(stderr, "%s: CPU time above the %llu ns elapsed\n", names[i], (unsigned long long)elapsed);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+#endif
+
+static void worker1(void) {
+    for (int i = 0; i < 5; ++i) {
+        printf("worker1\n");
+        co_sleep(1000);
+    }
+}
+
+static void worker2(void) {
+    for (int i = 0; i < 10; ++i) {
+        // Wait for the "receive interrupt"
+        uint8_t buffer[8];
+        size_t n = co_chan_read(&rx, buffer, sizeof(buffer));
+        printf("worker2: received %.*s\n", (int)n, (const char *)buffer);
+    }
+}
+
+// Plays the role of the UART receive interrupt, a few bytes at a time
+static void on_alarm(int sig) {
+    static uint8_t next = 'a';
+    (void)sig;
+    co_host_isr_enter();
+    for (int i = 0; i < 3; ++i) {
+        co_chan_put(&rx, next);
+        next = (next == 'z') ? 'a' : (uint8_t)(next + 1);
+    }
+    co_host_isr_exit();
+}
+
+int main(void) {
+#if CO_CPU_STATS
+    uint64_t start = wall_ns();
+#endif
+    co_chan_init(&rx, rx_buf, sizeof(rx_buf));
+#if CO_TRACE
+    co_trace_init();
+    trace_out = fopen("trace.bin", "wb");
+    if (trace_out == NULL) {
+        perror("trace.bin");
+        return 1;
+    }
+#endif
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_alarm;
+    sigaction(SIGALRM, &sa, NULL);
+
+    struct itimerval it = {{0, 500000}, {0, 500000}};
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    co_init(&co1, stack1, sizeof(stack1), worker1);
+    co_init(&co2, stack2, sizeof(stack2), worker2);
+
+    co_resume(&co1);
+    co_resume(&co2);
+
+    // SIGALRM only runs while blocked in pselect, so it cannot slip in
+    // between co_poll and the wait
+    sigset_t alarm_mask, orig_mask;
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alarm_mask, &orig_mask);
+
+    while ((co_status(&co1) != CO_STATUS_FINISHED) || (co_status(&co2) != CO_STATUS_FINISHED)) {
+        // Loop iteration to allow for features like sleep or resume from interrupt
+        uint32_t ticks;
+        co_poll_t poll = co_poll(&ticks);
+#if CO_TRACE
+        trace_drain();
+#endif
+        if (poll == CO_POLL_READY) {
+            continue;
+        }
+
+        struct timespec timeout = { ticks / 1000, (long)(ticks % 1000) * 1000000L };
+        pselect(0, NULL, NULL, NULL, (poll == CO_POLL_DEADLINE) ? &timeout : NULL, &orig_mask);
+    }
+
+#if CO_TRACE
+    trace_drain();
+    fclose(trace_out);
+    fprintf(stderr, "trace.bin: -n %04x=worker1 -n %04x=worker2\n",
+            (unsigned)(uint16_t)(uintptr_t)&co1, (unsigned)(uint16_t)(uintptr_t)&co2);
+#endif
+#if CO_CPU_STATS
+    if (!cpu_report(wall_ns() - start)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
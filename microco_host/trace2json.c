@@ -0,0 +1,241 @@
+/*
+ * trace2json.c - Convert a CO_TRACE dump into Chrome trace JSON
+ *
+ *   trace2json [-f hz | -l load [-s shift]] [-n id=name]... [trace.bin] > trace.json
+ *
+ * The input is the records returned by co_trace_drain, written as they are
+ * (8 bytes each, little-endian). -f is the rate of the timestamps: CPU
+ * clock on RV32, 1000000000 (the default) on the host. Cortex-M records
+ * hold the raw tick count and SysTick->VAL instead: -l gives the SysTick
+ * LOAD value (SystemCoreClock / 1000 - 1 with a 1 ms HAL tick) and -s the
+ * CO_TRACE_VAL_SHIFT of the build, and the conversion to time happens here.
+ * -n names a coroutine or task from the 16-bit id in the records, given in
+ * hex; others are shown as "co <id>".
+ *
+ * Each coroutine and task gets its own track with one slice per run, the
+ * main context is track 0. Waits, sleeps, wakeups and finishes are instant
+ * events on the track of the coroutine concerned. Open the output in
+ * chrome://tracing or ui.perfetto.dev.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAMES 64
+#define MAX_TRACKS 256
+
+/* Same values as co_trace_event_t, the tool does not depend on the build
+   options of the traced firmware.
+*/
+enum {
+    EV_SWITCH,
+    EV_WAIT,
+    EV_SLEEP,
+    EV_WAKE,
+    EV_FINISH,
+    EV_TASK_RUN,
+    EV_TASK_STOP,
+    EV_LOST
+};
+
+static unsigned    g_ids[MAX_NAMES];
+static const char *g_names[MAX_NAMES];
+static int         g_n_names = 0;
+static int         g_first = 1;
+static unsigned    g_tracks[MAX_TRACKS];
+static int         g_n_tracks = 0;
+
+static const char *name_of(unsigned id, char *buf, size_t len) {
+    if (id == 0) {
+        return "main";
+    }
+    for (int i = 0; i < g_n_names; ++i) {
+        if (g_ids[i] == id) {
+            return g_names[i];
+        }
+    }
+    snprintf(buf, len, "co %04x", id);
+    return buf;
+}
+
+static void emit(const char *ph, const char *name, unsigned tid, double us, const char *extra) {
+    printf("%s\n  {\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u%s}",
+           g_first ? "" : ",", name, ph, us, tid, extra);
+    g_first = 0;
+}
+
+/* Name the track of id the first time it shows up */
+static void track(unsigned id) {
+    for (int i = 0; i < g_n_tracks; ++i) {
+        if (g_tracks[i] == id) {
+            return;
+        }
+    }
+    if (g_n_tracks < MAX_TRACKS) {
+        g_tracks[g_n_tracks++] = id;
+    }
+
+    char buf[16];
+    char extra[128];
+    snprintf(extra, sizeof(extra), ",\"args\":{\"name\":\"%s\"}", name_of(id, buf, sizeof(buf)));
+    emit("M", "thread_name", id, 0.0, extra);
+}
+
+static void instant(const char *name, unsigned tid, double us) {
+    emit("i", name, tid, us, ",\"s\":\"t\"");
+}
+
+/* Cortex-M timestamp: ms modulo 2^15, SysTick pending, SysTick->VAL. Same
+   fix-up as co_port_cpu_time: a reload that happened while the tick
+   interrupt was held off leaves ms one behind. Returns ms since the first
+   record in *ms_total and the SysTick clocks elapsed within that ms.
+*/
+static uint32_t systick_time(uint32_t time, uint32_t load, unsigned shift, uint64_t *ms_total) {
+    static uint32_t last_ms;
+    static int      have_last = 0;
+
+    uint32_t ms  = time >> 17;
+    uint32_t val = (time & 0xFFFFu) << shift;
+    if ((time & 0x10000u) && (val > (load >> 1))) {
+        ms = (ms + 1) & 0x7FFFu;
+    }
+    // Modulo 2^15, records are in order and less than 32 s apart
+    if (have_last) {
+        *ms_total += (ms - last_ms) & 0x7FFFu;
+    }
+    last_ms = ms;
+    have_last = 1;
+    return (val > load) ? 0 : (load - val);
+}
+
+int main(int argc, char **argv) {
+    double   hz = 1e9;
+    uint32_t load = 0;      // Cortex-M SysTick LOAD, 0 for a plain counter
+    unsigned shift = 0;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-f") == 0) && (i + 1 < argc)) {
+            hz = strtod(argv[++i], NULL);
+        }
+        else if ((strcmp(argv[i], "-l") == 0) && (i + 1 < argc)) {
+            load = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc)) {
+            shift = (unsigned)strtoul(argv[++i], NULL, 0);
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc) && (g_n_names < MAX_NAMES)) {
+            char *arg = argv[++i];
+            char *eq  = strchr(arg, '=');
+            if (eq == NULL) {
+                fprintf(stderr, "trace2json: -n expects id=name\n");
+                return 2;
+            }
+            *eq = '\0';
+            g_ids[g_n_names]   = (unsigned)strtoul(arg, NULL, 16);
+            g_names[g_n_names] = eq + 1;
+            ++g_n_names;
+        }
+        else if (argv[i][0] != '-') {
+            path = argv[i];
+        }
+        else {
+            fprintf(stderr, "usage: trace2json [-f hz | -l load [-s shift]] [-n id=name]... [trace.bin]\n");
+            return 2;
+        }
+    }
+
+    FILE *in = path ? fopen(path, "rb") : stdin;
+    if (in == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    printf("{\"traceEvents\":[");
+
+    uint8_t  rec[8];
+    uint32_t last = 0;
+    uint64_t ticks = 0;     // unwrapped time since the first record
+    double   us = 0.0;
+    int      have_last = 0;
+    unsigned running = 0;   // context of the open run slice
+    int      open = 0;
+    char     buf[16];
+
+    while (fread(rec, sizeof(rec), 1, in) == 1) {
+        uint32_t time  = (uint32_t)rec[0] | ((uint32_t)rec[1] << 8) | ((uint32_t)rec[2] << 16) | ((uint32_t)rec[3] << 24);
+        unsigned id    = (unsigned)rec[4] | ((unsigned)rec[5] << 8);
+        unsigned event = rec[6];
+        unsigned arg   = rec[7];
+
+        if (load != 0) {
+            uint32_t sub = systick_time(time, load, shift, &ticks);
+            us = (double)ticks * 1e3 + (double)sub * 1e3 / ((double)load + 1.0);
+        }
+        else {
+            // Timestamps wrap modulo 2^32, records are in order
+            if (have_last) {
+                ticks += (uint32_t)(time - last);
+            }
+            last = time;
+            have_last = 1;
+            us = (double)ticks * 1e6 / hz;
+        }
+
+        track(id);
+        const char *name = name_of(id, buf, sizeof(buf));
+        switch (event) {
+        case EV_SWITCH:
+            if (open) {
+                emit("E", name_of(running, buf, sizeof(buf)), running, us, "");
+                name = name_of(id, buf, sizeof(buf));
+            }
+            emit("B", name, id, us, "");
+            running = id;
+            open = 1;
+            break;
+        case EV_WAIT:
+            instant("wait", id, us);
+            break;
+        case EV_SLEEP:
+            instant("sleep", id, us);
+            break;
+        case EV_WAKE:
+            instant(arg ? "wake from ISR" : "wake", id, us);
+            break;
+        case EV_FINISH:
+            instant("finish", id, us);
+            break;
+        case EV_TASK_RUN:
+            emit("B", name, id, us, "");
+            break;
+        case EV_TASK_STOP:
+            emit("E", name, id, us, "");
+            break;
+        case EV_LOST: {
+            char extra[64];
+            snprintf(extra, sizeof(extra), ",\"s\":\"g\",\"args\":{\"records\":%u}", arg);
+            emit("i", "lost", 0, us, extra);
+            // Runs in progress are unknown after a gap
+            if (open) {
+                emit("E", name_of(running, buf, sizeof(buf)), running, us, "");
+                open = 0;
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "trace2json: unknown event %u\n", event);
+            break;
+        }
+    }
+    if (open) {
+        emit("E", name_of(running, buf, sizeof(buf)), running, us, "");
+    }
+    printf("\n]}\n");
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * bench_cortexm.c - Cortex-M platform of the scheduler benchmarks
+ * (microco_bench), for qemu-system-arm -M microbit (Cortex-M0) and
+ * -M mps2-an385 (Cortex-M3)
+ *
+ * Time comes from the 1 ms tick of startup.c and SysTick->VAL within the
+ * current millisecond, in ns. Run QEMU with -icount shift=0: one
+ * instruction then takes 1 ns of virtual time, so the results count
+ * instructions and do not depend on the host. The interrupt is PendSV,
+ * pended from thread mode; it is taken before the next instruction.
+ * Output goes through semihosting.
+ */
+#include <stdint.h>
+
+#include "microco.h"
+#include "bench.h"
+#include "semihost.h"
+
+#define SYST_RVR    (*(volatile uint32_t *)0xE000E014u)
+#define SYST_CVR    (*(volatile uint32_t *)0xE000E018u)
+#define SCB_ICSR    (*(volatile uint32_t *)0xE000ED04u)
+
+#define ICSR_PENDSVSET  (1u << 28)
+
+#ifndef SYSCLK_HZ
+#define SYSCLK_HZ 25000000u     /* mps2-an385 */
+#endif
+
+extern uint32_t HAL_GetTick(void);
+
+void PendSV_Handler(void);
+
+uint32_t bench_now(void) {
+    uint32_t ms;
+    uint32_t val;
+    // Read again if the tick interrupt ran in between
+    do {
+        ms  = HAL_GetTick();
+        val = SYST_CVR;
+    } while (ms != HAL_GetTick());
+    return ms * 1000000u + ((SYST_RVR - val) * 1000u) / (SYSCLK_HZ / 1000000u);
+}
+
+void bench_print(const char *s) {
+    semihost_puts(s);
+}
+
+void bench_isr_pend(void) {
+    SCB_ICSR = ICSR_PENDSVSET;
+    __asm volatile ("dsb\n"
+                    "isb" ::: "memory");
+}
+
+void PendSV_Handler(void) {
+    bench_isr();
+}
+
+int main(void) {
+    bench_run();
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * guard.c - CO_STACK_GUARD check on qemu-system-arm -M mps2-an385 (Cortex-M3)
+ *
+ * Two coroutines on adjacent stacks. The first one switches back and forth
+ * normally, which must not fault. The second one recurses until it overflows
+ * and must hit the MPU guard at the bottom of its own stack, before it
+ * reaches the stack below it.
+ */
+#include <stdint.h>
+
+#include "microco.h"
+#include "semihost.h"
+
+#define SCB_SHCSR   (*(volatile uint32_t *)0xE000ED24u)
+#define SCB_CFSR    (*(volatile uint32_t *)0xE000ED28u)
+#define SCB_MMFAR   (*(volatile uint32_t *)0xE000ED34u)
+
+#define MMFSR_MMARVALID (1u << 7)
+
+static co_t co_ok;
+static co_t co_deep;
+
+/* stack_ok sits right below stack_deep, overflowing stack_deep without a
+   guard would silently corrupt it */
+static struct {
+    uint8_t ok[256];
+    uint8_t deep[256];
+} stacks __attribute__((aligned(256)));
+
+static volatile uint32_t depth = 0;
+static uint8_t *volatile g_sink;     // keeps every frame alive
+
+static void ok_worker(void) {
+    for (int i = 0; i < 3; ++i) {
+        co_yield();
+    }
+}
+
+static uint32_t recurse(uint32_t n) {
+    uint8_t pad[24];
+    pad[0] = (uint8_t)n;
+    g_sink = pad;
+    depth = n;
+    uint32_t r = recurse(n + 1);
+    g_sink = pad;
+    return r + pad[0];
+}
+
+static void deep_worker(void) {
+    recurse(0);
+}
+
+void fault_report(uint32_t exception) {
+    uint32_t cfsr  = SCB_CFSR;
+    uint32_t mmfar = SCB_MMFAR;
+    uint32_t guard = (uint32_t)stacks.deep;
+
+    semihost_puts("fault, exception ");
+    semihost_putu(exception);
+    semihost_puts(", depth ");
+    semihost_putu(depth);
+    semihost_puts("\n");
+
+    // Data access violation inside the guard of co_deep
+    if ((cfsr & MMFSR_MMARVALID) && (mmfar >= guard) && (mmfar < guard + 32u)) {
+        semihost_puts("stack guard hit: PASS\n");
+        semihost_exit(1);
+    }
+    semihost_puts("FAIL\n");
+    semihost_exit(0);
+}
+
+int main(void) {
+    // MemManage instead of escalating to HardFault
+    SCB_SHCSR |= (1u << 16);
+
+    co_init(&co_ok, stacks.ok, sizeof(stacks.ok), ok_worker);
+    co_init(&co_deep, stacks.deep, sizeof(stacks.deep), deep_worker);
+
+    while (co_status(&co_ok) != CO_STATUS_FINISHED) {
+        co_resume(&co_ok);
+    }
+    semihost_puts("switching with guard: ok\n");
+
+    co_resume(&co_deep);
+
+    semihost_puts("FAIL: overflow not caught\n");
+    return 1;
+}
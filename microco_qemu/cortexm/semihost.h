@@ -0,0 +1,39 @@
+/*
+ * semihost.h - Output and exit through ARM semihosting (QEMU -semihosting)
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define SEMIHOST_SYS_WRITE0     0x04u
+#define SEMIHOST_SYS_EXIT       0x18u
+#define SEMIHOST_EXIT_OK        0x20026u    /* ADP_Stopped_ApplicationExit */
+#define SEMIHOST_EXIT_ERROR     0x20023u    /* ADP_Stopped_RunTimeErrorUnknown */
+
+static inline uint32_t semihost_call(uint32_t op, const void *arg) {
+    register uint32_t r0 __asm("r0") = op;
+    register const void *r1 __asm("r1") = arg;
+    __asm volatile ("bkpt #0xab" : "+r" (r0) : "r" (r1) : "memory");
+    return r0;
+}
+
+static inline void semihost_puts(const char *s) {
+    semihost_call(SEMIHOST_SYS_WRITE0, s);
+}
+
+static inline void semihost_putu(uint32_t v) {
+    char buf[11];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = (char)('0' + (v % 10));
+        v /= 10;
+    } while (v);
+    semihost_puts(&buf[i]);
+}
+
+static inline void semihost_exit(int ok) {
+    semihost_call(SEMIHOST_SYS_EXIT, (const void *)(ok ? SEMIHOST_EXIT_OK : SEMIHOST_EXIT_ERROR));
+    while (1) {
+    }
+}
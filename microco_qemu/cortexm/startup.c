@@ -0,0 +1,111 @@
+/*
+ * startup.c - Minimal Cortex-M startup for the QEMU builds
+ *
+ * Vector table, .data/.bss setup, a 1 ms SysTick behind HAL_GetTick (the
+ * time source of the Cortex-M port) and fault handlers that report through
+ * semihosting. Fault handlers switch to their own stack first: after a stack
+ * overflow the faulting stack cannot be trusted.
+ */
+#include <stdint.h>
+
+#include "semihost.h"
+
+#ifndef SYSCLK_HZ
+#define SYSCLK_HZ 25000000u     /* mps2-an385 */
+#endif
+
+#define SYST_CSR    (*(volatile uint32_t *)0xE000E010u)
+#define SYST_RVR    (*(volatile uint32_t *)0xE000E014u)
+#define SYST_CVR    (*(volatile uint32_t *)0xE000E018u)
+
+extern uint32_t __stack_top;
+extern uint32_t __data_load, __data_start, __data_end;
+extern uint32_t __bss_start, __bss_end;
+
+int main(void);
+void Reset_Handler(void);
+void HardFault_Handler(void);
+void MemManage_Handler(void);
+void SysTick_Handler(void);
+void PendSV_Handler(void);
+
+/* Overridable by the test: called on its own stack for HardFault and
+   MemManage, never returns */
+void fault_report(uint32_t exception) __attribute__((weak));
+
+static volatile uint32_t g_tick = 0;
+uint32_t g_fault_stack[128] __attribute__((aligned(8)));
+
+static void Default_Handler(void) {
+    semihost_puts("unexpected exception\n");
+    semihost_exit(0);
+}
+
+/* Defined by programs that pend it */
+void PendSV_Handler(void) __attribute__((weak, alias("Default_Handler")));
+
+__attribute__((section(".vectors"), used))
+static void (* const g_vectors[16 + 32])(void) = {
+    (void (*)(void))&__stack_top,
+    Reset_Handler,
+    Default_Handler,        /* NMI */
+    HardFault_Handler,
+    MemManage_Handler,
+    Default_Handler,        /* BusFault */
+    Default_Handler,        /* UsageFault */
+    0, 0, 0, 0,
+    Default_Handler,        /* SVC */
+    Default_Handler,        /* DebugMon */
+    0,
+    PendSV_Handler,
+    SysTick_Handler,
+};
+
+void Reset_Handler(void) {
+    uint32_t *src = &__data_load;
+    for (uint32_t *dst = &__data_start; dst < &__data_end; ) {
+        *dst++ = *src++;
+    }
+    for (uint32_t *dst = &__bss_start; dst < &__bss_end; ) {
+        *dst++ = 0;
+    }
+
+    SYST_RVR = (SYSCLK_HZ / 1000u) - 1u;
+    SYST_CVR = 0;
+    SYST_CSR = 0x7u;    /* processor clock, interrupt, enable */
+
+    semihost_exit(main() == 0);
+}
+
+void SysTick_Handler(void) {
+    g_tick++;
+}
+
+uint32_t HAL_GetTick(void) {
+    return g_tick;
+}
+
+void fault_report(uint32_t exception) {
+    semihost_puts("fault, exception ");
+    semihost_putu(exception);
+    semihost_puts("\n");
+    semihost_exit(0);
+}
+
+/* Switch to the top of g_fault_stack (512 bytes) without touching the
+   current stack */
+__attribute__((naked)) void HardFault_Handler(void) {
+    __asm volatile ("ldr r0, =g_fault_stack + 512\n"
+                    "mov sp, r0\n"
+                    "movs r0, #3\n"
+                    "bl fault_report\n"
+                    ".ltorg\n");
+}
+
+__attribute__((naked)) void MemManage_Handler(void) {
+    __asm volatile ("ldr r0, =g_fault_stack + 512\n"
+                    "mov sp, r0\n"
+                    "movs r0, #4\n"
+                    "bl fault_report\n"
+                    ".ltorg\n");
+}
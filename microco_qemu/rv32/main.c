@@ -0,0 +1,136 @@
+/*
+ * main.c - microco on qemu-system-riscv32 -M virt
+ *
+ * Exercises the RV32 port:
+ * - co_resume + co_yield ping-pong timed with mcycle (two context switches
+ *   per round trip). Run QEMU with -icount shift=0 so mcycle counts
+ *   instructions instead of host time.
+ * - The machine timer interrupt resumes a waiting coroutine from trap
+ *   context, which is then run by co_loop.
+ * - co_sleep on top of co_port_get_tick, derived from mtime.
+ */
+#include <stdint.h>
+
+#include "microco.h"
+
+#define UART0_THR       ((volatile uint8_t *)0x10000000u)
+#define CLINT_MTIMECMP  ((volatile uint32_t *)0x02004000u)
+#define CLINT_MTIME     ((volatile uint32_t *)0x0200BFF8u)
+#define TEST_FINISHER   ((volatile uint32_t *)0x00100000u)
+#define MTIME_PER_MS    10000u
+
+#define MCAUSE_MTI      0x80000007u
+
+static co_t co_ping;
+static co_t co_timer;
+
+static uint8_t stack_ping[256] __attribute__((aligned(16)));
+static uint8_t stack_timer[256] __attribute__((aligned(16)));
+
+static volatile uint32_t timer_irqs = 0;
+
+static void uart_puts(const char *s) {
+    while (*s) {
+        *UART0_THR = (uint8_t)*s++;
+    }
+}
+
+static void uart_putu(uint32_t v) {
+    char buf[11];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = (char)('0' + (v % 10));
+        v /= 10;
+    } while (v);
+    uart_puts(&buf[i]);
+}
+
+static uint64_t mtime_read(void) {
+    uint32_t hi, lo;
+    do {
+        hi = CLINT_MTIME[1];
+        lo = CLINT_MTIME[0];
+    } while (hi != CLINT_MTIME[1]);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void mtimecmp_write(uint64_t t) {
+    CLINT_MTIMECMP[1] = 0xFFFFFFFFu;
+    CLINT_MTIMECMP[0] = (uint32_t)t;
+    CLINT_MTIMECMP[1] = (uint32_t)(t >> 32);
+}
+
+static inline uint32_t mcycle(void) {
+    uint32_t c;
+    __asm volatile ("csrr %0, mcycle" : "=r" (c));
+    return c;
+}
+
+/* Time source of the RV32 port */
+uint32_t co_port_get_tick(void) {
+    return (uint32_t)(mtime_read() / MTIME_PER_MS);
+}
+
+/* Called from trap_entry in startup.S */
+void trap_handler(uint32_t mcause) {
+    if (mcause == MCAUSE_MTI) {
+        mtimecmp_write(mtime_read() + 50u * MTIME_PER_MS);
+        timer_irqs++;
+        if (co_status(&co_timer) == CO_STATUS_WAITING) {
+            co_resume(&co_timer);
+        }
+    }
+}
+
+static void pinger(void) {
+    while (1) {
+        co_yield();
+    }
+}
+
+static void ticker(void) {
+    for (int i = 0; i < 5; ++i) {
+        // Resumed by the timer interrupt
+        co_yield();
+        uart_puts("ticker: timer irq ");
+        uart_putu(timer_irqs);
+        uart_puts("\n");
+    }
+
+    uint32_t start = co_port_get_tick();
+    co_sleep(200);
+    uart_puts("ticker: slept ");
+    uart_putu(co_port_get_tick() - start);
+    uart_puts(" ms\n");
+}
+
+int main(void) {
+    co_init(&co_ping, stack_ping, sizeof(stack_ping), pinger);
+    co_init(&co_timer, stack_timer, sizeof(stack_timer), ticker);
+
+    const uint32_t rounds = 1000;
+    co_resume(&co_ping);
+    uint32_t start = mcycle();
+    for (uint32_t i = 0; i < rounds; ++i) {
+        co_resume(&co_ping);
+    }
+    uint32_t cycles = mcycle() - start;
+    uart_puts("co_resume + co_yield: ");
+    uart_putu(cycles / rounds);
+    uart_puts(" cycles\n");
+
+    co_resume(&co_timer);
+
+    // Enable the machine timer interrupt
+    mtimecmp_write(mtime_read() + 50u * MTIME_PER_MS);
+    __asm volatile ("csrs mie, %0" :: "r" (0x80u));
+
+    while (co_status(&co_timer) != CO_STATUS_FINISHED) {
+        co_loop();
+    }
+
+    uart_puts("done\n");
+    *TEST_FINISHER = 0x5555u;
+    return 0;
+}
@@ -1,134 +1,1363 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#include "stm32l0xx_hal.h"
 #include "microco.h"
-
-// Implemented in assembly
-extern void context_switch(uint32_t **from_sp, uint32_t **to_sp);
+#include "microco_port.h"
 
 /* Globals for simple single-scheduler setup */
-static co_t    g_main_co;
+static co_t    g_main_co = { .node.status = CO_STATUS_MAIN };
 static co_t   *g_current = &g_main_co;
+#if CO_STACK_INFO
 static co_t   *g_list    = NULL;       // linked list of coroutines
+#endif
+static co_node_t *g_ready_head[CO_PRIORITIES]; // one FIFO of coroutines and tasks per priority
+static co_node_t *g_ready_tail[CO_PRIORITIES];
+static uint32_t   g_ready_map = 0;     // bit p set when FIFO p is not empty
+static co_node_t *g_sleep_head = NULL; // sleeping coroutines and tasks, earliest deadline first
+#if CO_SHARED_STACK
+static uint32_t *g_shared_base  = NULL;  // stack shared by co_init_shared coroutines
+static uint32_t  g_shared_size  = 0;
+static uint32_t *g_shared_top   = NULL;
+static co_t     *g_shared_owner = NULL;  // whose frames are on the shared stack
+#endif
+#if CO_CPU_STATS
+static uint8_t   g_cpu_started  = 0;     // main's first run has a start time
+#endif
+
+/* Key of a coroutine initialized and not finished since, see
+   co_init_common. The constant is odd, so no aligned co_t gets key 0.
+*/
+#define CO_KEY(co) ((uint32_t)(uintptr_t)(co) ^ 0xC0DE5EEDu)
+
+#if CO_POOL
+#if CO_STACK_GUARD
+#define CO_POOL_ALIGN 32    // MPU region base
+#else
+#define CO_POOL_ALIGN 8
+#endif
+
+#if (CO_POOL_SMALL_SIZE % CO_POOL_ALIGN) || (CO_POOL_MEDIUM_SIZE % CO_POOL_ALIGN) || (CO_POOL_LARGE_SIZE % CO_POOL_ALIGN)
+#error "microco: pool stack sizes must keep every stack aligned"
+#endif
+
+// Empty classes still get one co_t and 8 bytes of stack, C has no empty arrays
+#define CO_POOL_SLOTS(n)        ((n) ? (n) : 1)
+#define CO_POOL_BYTES(n, size)  ((n) ? (n) * (size) : 8)
+#define CO_POOL_FREE(n)         ((n) ? (0xFFFFFFFFu >> (32 - (n))) : 0u)
+
+static co_t    g_pool_co_small[CO_POOL_SLOTS(CO_POOL_SMALL_COUNT)];
+static co_t    g_pool_co_medium[CO_POOL_SLOTS(CO_POOL_MEDIUM_COUNT)];
+static co_t    g_pool_co_large[CO_POOL_SLOTS(CO_POOL_LARGE_COUNT)];
+static uint8_t g_pool_stack_small[CO_POOL_BYTES(CO_POOL_SMALL_COUNT, CO_POOL_SMALL_SIZE)] __attribute__((aligned(CO_POOL_ALIGN)));
+static uint8_t g_pool_stack_medium[CO_POOL_BYTES(CO_POOL_MEDIUM_COUNT, CO_POOL_MEDIUM_SIZE)] __attribute__((aligned(CO_POOL_ALIGN)));
+static uint8_t g_pool_stack_large[CO_POOL_BYTES(CO_POOL_LARGE_COUNT, CO_POOL_LARGE_SIZE)] __attribute__((aligned(CO_POOL_ALIGN)));
+
+typedef struct {
+    co_t     *co;           // slots
+    uint8_t  *stacks;       // one stack_size slab per slot
+    uint32_t  stack_size;
+    uint32_t  free;         // bit i set when slot i is free
+    uint8_t   count;
+    uint8_t   used;
+    uint8_t   peak;
+} co_pool_t;
+
+static co_pool_t g_pool[CO_POOL_CLASSES] = {
+    { g_pool_co_small,  g_pool_stack_small,  CO_POOL_SMALL_SIZE,  CO_POOL_FREE(CO_POOL_SMALL_COUNT),  CO_POOL_SMALL_COUNT,  0, 0 },
+    { g_pool_co_medium, g_pool_stack_medium, CO_POOL_MEDIUM_SIZE, CO_POOL_FREE(CO_POOL_MEDIUM_COUNT), CO_POOL_MEDIUM_COUNT, 0, 0 },
+    { g_pool_co_large,  g_pool_stack_large,  CO_POOL_LARGE_SIZE,  CO_POOL_FREE(CO_POOL_LARGE_COUNT),  CO_POOL_LARGE_COUNT,  0, 0 },
+};
+#endif
+
+#if CO_TRACE
+#define CO_TRACE_MAGIC 0x434F5452u  // "COTR"
+
+typedef struct {
+    uint32_t          magic;    // CO_TRACE_MAGIC once initialized
+    volatile uint32_t head;     // records written
+    uint32_t          tail;     // records drained
+    co_trace_rec_t    rec[CO_TRACE_SIZE];
+} co_trace_t;
+
+#ifdef CO_TRACE_SECTION
+static co_trace_t g_trace __attribute__((section(CO_TRACE_SECTION)));
+#else
+static co_trace_t g_trace;
+#endif
+
+static void co_trace_put(uint8_t event, const void *who, uint8_t arg);
+#define CO_TRACE_PUT(event, who, arg) co_trace_put((event), (who), (arg))
+#else
+#define CO_TRACE_PUT(event, who, arg) ((void)0)
+#endif
 
 /* Forward declarations */
-static void co_entry(void);
-static void co_return_to_main(void);
+static void *co_context_switch(co_t *from, co_t *to, void *value);
+static void co_entry(void *arg);
+static void co_entry_arg(void *arg);
+static void co_init_stack(co_t *co, void *stack_mem, size_t stack_bytes,
+                          void (*entry)(void *), void *arg);
+static void *co_return_to_caller(void *value);
+static void co_switch_to(co_t *next);
+static void co_wait_switch(void);
+static co_wait_t co_wait_switch_until(uint32_t deadline);
+static co_wait_t co_event_wait_until(co_event_t *ev, uint32_t deadline, int timed);
+static void co_wake(co_node_t *n);
+static co_node_t *co_ready_pop(void);
+static void co_ready_push_front(co_node_t *n);
+static int co_wait_begin(co_node_t *n);
+static void co_sleep_insert(co_node_t *n);
+static void co_sleep_remove(co_node_t *n);
+static void co_set_running(co_node_t *n);
+static void co_node_init(co_node_t *n);
+static void co_task_run(co_task_t *task);
+static void co_set_prio(co_node_t *n, uint32_t prio);
+static int co_event_begin_wait(co_event_t *ev, co_node_t *n);
+static int co_init_common(co_t *co, co_func fn);
+static void co_list_add(co_t *co);
+static void co_list_remove(co_t *co);
+static void co_finish(co_t *self);
+static void co_retire(co_t *co);
+static void co_ready_remove(co_node_t *n);
+#if CO_STACK_INFO
+static void co_paint(uint32_t *bottom, size_t stack_bytes);
+#endif
+#if CO_SHARED_STACK
+static int co_shared_claim(co_t *co);
+#endif
+#if CO_POOL
+static void co_pool_release(co_t *co);
+#endif
+#if CO_CPU_STATS
+static void co_cpu_account(co_t *from, co_t *to);
+#endif
 
 /* Initialize a coroutine with a user-provided stack buffer */
 void co_init(co_t *co, void *stack_mem, size_t stack_bytes,
                            co_func fn)
 {
-    co->fn   = fn;
-    co->status = CO_STATUS_IDLE;
-    co->next = g_list;
-    g_list   = co;
+    if (!co_init_common(co, fn)) {
+        return;
+    }
+    co_init_stack(co, stack_mem, stack_bytes, co_entry, NULL);
+}
 
-    uint32_t *bottom = (uint32_t *)stack_mem;
-    for (int i = 0; i < 16; ++i)
-    {
-        *bottom++ = 0xDEADBEEF;
+void co_init_arg(co_t *co, void *stack_mem, size_t stack_bytes,
+                           co_func_arg fn, void *arg)
+{
+    // Converted back by co_entry_arg before the call
+    if (!co_init_common(co, (co_func)fn)) {
+        return;
     }
+    co->node.with_arg = 1;
+    co_init_stack(co, stack_mem, stack_bytes, co_entry_arg, arg);
+}
+
+static void co_init_stack(co_t *co, void *stack_mem, size_t stack_bytes,
+                          void (*entry)(void *), void *arg)
+{
+#if CO_SHARED_STACK
+    co->save_buf  = NULL;
+    co->save_size = 0;
+    co->saved     = 0;
+#endif
+#if CO_STACK_INFO
+    co->stack_base = (uint32_t *)stack_mem;
+    co->stack_size = (uint32_t)stack_bytes;
+    co_paint((uint32_t *)stack_mem, stack_bytes);
+#endif
+
+#if CO_STACK_GUARD
+    co_port_guard_init(co);
+#endif
 
     /* Top of stack, 8-byte aligned */
     uint32_t *sp = (uint32_t *)(((uintptr_t)stack_mem + stack_bytes) & ~((uintptr_t)7));
 
-    /* Prepare an initial "frame" so ctx_switch will pop into co_entry */
-    *--sp = (uint32_t)co_entry;  /* LR for first return in target context */
-    /* Reserve space for r4-r11 we pop in ctx_switch (9 regs including LR already set) */
-    for (int i = 0; i < 8; ++i) *--sp = 0;
+    /* Prepare an initial "frame" so context_switch will pop into entry(arg) */
+    co->sp = co_port_init_stack(sp, entry, arg);
+}
+
+#if CO_SHARED_STACK
+void co_shared_stack(void *stack_mem, size_t stack_bytes) {
+    g_shared_base  = (uint32_t *)stack_mem;
+    g_shared_size  = (uint32_t)stack_bytes;
+    g_shared_top   = (uint32_t *)(((uintptr_t)stack_mem + stack_bytes) & ~((uintptr_t)7));
+    g_shared_owner = NULL;
+#if CO_STACK_INFO
+    co_paint(g_shared_base, stack_bytes);
+#endif
+}
+
+void co_init_shared(co_t *co, void *save_mem, size_t save_bytes,
+                           co_func fn)
+{
+    if (g_shared_base == NULL) {
+        co_port_break();    // co_shared_stack first
+        return;
+    }
+
+    if (!co_init_common(co, fn)) {
+        return;
+    }
+
+#if CO_STACK_INFO
+    co->stack_base = g_shared_base;
+    co->stack_size = g_shared_size;
+#endif
+    co->save_buf   = (uint32_t *)save_mem;
+    co->save_size  = (uint32_t)save_bytes;
+    co->saved      = 0;
+
+#if CO_STACK_GUARD
+    co_port_guard_init(co);
+#endif
+
+    // The initial frame is built on the shared stack when it first runs
+    co->sp = NULL;
+}
+#endif
+
+#if CO_POOL
+co_t *co_spawn(co_func_arg fn, void *arg, co_pool_class_t size_class) {
+    if (((uint32_t)size_class >= CO_POOL_CLASSES) || co_port_in_isr()) {
+        co_port_break();
+        return NULL;
+    }
+
+    co_pool_t *pool = &g_pool[size_class];
+    if (pool->free == 0) {
+        return NULL;
+    }
+
+    uint32_t i = co_port_highest_bit(pool->free);
+    pool->free &= ~(1u << i);
+    if (++pool->used > pool->peak) {
+        pool->peak = pool->used;
+    }
+
+    co_t *co = &pool->co[i];
+    co_init_arg(co, pool->stacks + i * pool->stack_size, pool->stack_size, fn, arg);
+    co_wake(&co->node);
+    return co;
+}
+
+void co_pool_info(co_pool_class_t size_class, co_pool_info_t *info) {
+    if ((uint32_t)size_class >= CO_POOL_CLASSES) {
+        co_port_break();
+        return;
+    }
+
+    const co_pool_t *pool = &g_pool[size_class];
+    info->stack_size = pool->stack_size;
+    info->count      = pool->count;
+    info->used       = pool->used;
+    info->peak       = pool->peak;
+}
+
+/* Give the slot of a finished spawned coroutine back. Its stack is still
+   the current one until the switch out, nothing can take the slot before:
+   co_spawn is not called from interrupts.
+*/
+static void co_pool_release(co_t *co) {
+    for (uint32_t c = 0; c < CO_POOL_CLASSES; ++c) {
+        co_pool_t *pool = &g_pool[c];
+        if ((co >= pool->co) && (co < pool->co + pool->count)) {
+            pool->free |= 1u << (uint32_t)(co - pool->co);
+            --pool->used;
+            return;
+        }
+    }
+}
+#endif
+
+#if CO_JOIN
+/* Wait for co to finish. Resumed by anything else: wait again. */
+void co_join(co_t *co) {
+    co_node_t *self = &g_current->node;
+    if ((self->status != CO_STATUS_RUNNING) || (co == g_current) ||
+        (co->joiner && (co->joiner != self))) {
+        co_port_break();
+        return;
+    }
+
+    g_current->wait_slot = &co->joiner;
+    while (co->node.status != CO_STATUS_FINISHED) {
+        co->joiner = self;
+        if (co_wait_begin(self)) {
+            co_wait_switch();
+        }
+    }
+    g_current->wait_slot = NULL;
+}
+
+/* Finish co from outside. Whatever it waits for forgets it under the same
+   interrupt mask, so a wakeup from an interrupt cannot queue it again.
+*/
+void co_remove(co_t *co) {
+    uint8_t status = co->node.status;
+    if ((status == CO_STATUS_RUNNING) || (status == CO_STATUS_MAIN) || co_port_in_isr()) {
+        co_port_break();
+        return;
+    }
+    if (status == CO_STATUS_FINISHED) {
+        return;
+    }
+    if (co->key != CO_KEY(co)) {
+        co_port_break();    // never initialized
+        return;
+    }
+
+    uint32_t irq = co_port_irq_save();
+    co->node.status = CO_STATUS_FINISHED;
+    CO_TRACE_PUT(CO_TRACE_FINISH, co, 0);
+    if (co->node.queued) {
+        co_ready_remove(&co->node);
+    }
+    if (co->node.sleeping) {
+        co_sleep_remove(&co->node);
+    }
+    if (co->wait_slot) {
+        if (*co->wait_slot == &co->node) {
+            *co->wait_slot = NULL;
+        }
+        co->wait_slot = NULL;
+    }
+    co_port_irq_restore(irq);
+
+#if CO_SHARED_STACK
+    if (g_shared_owner == co) {
+        // Its frames are dead, nothing to save
+        g_shared_owner = NULL;
+    }
+#endif
+    co_retire(co);
+}
+#endif
 
-    co->sp = sp;
+#if CO_STACK_INFO
+void co_reset(co_t *co) {
+    co_reset_arg(co, NULL);
 }
 
-/* Yield back to main context */
+void co_reset_arg(co_t *co, void *arg) {
+    if ((co->node.status != CO_STATUS_FINISHED) && (co->node.status != CO_STATUS_IDLE)) {
+        co_port_break();
+        return;
+    }
+
+    uint8_t prio     = co->node.prio;
+    uint8_t with_arg = co->node.with_arg;
+    (void)co_init_common(co, co->fn);
+    co->node.prio     = prio;
+    co->node.with_arg = with_arg;
+
+#if CO_SHARED_STACK
+    if (co->save_buf != NULL) {
+        // Rebuilt on the shared stack when it runs again
+        co->saved = 0;
+        co->sp    = NULL;
+        return;
+    }
+#endif
+    co_init_stack(co, co->stack_base, co->stack_size,
+                  with_arg ? co_entry_arg : co_entry, arg);
+}
+#endif
+
+/* Wait for co_resume as co_yield does, or until ms elapsed */
+co_wait_t co_yield_timeout(uint32_t ms) {
+    if (g_current->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return CO_WAIT_TIMEOUT;
+    }
+
+    if (co_wait_begin(&g_current->node) == 0) {
+        return CO_WAIT_WOKEN;
+    }
+    if (ms == CO_WAIT_FOREVER) {
+        co_wait_switch();
+        return CO_WAIT_WOKEN;
+    }
+    return co_wait_switch_until(co_port_get_tick() + ms);
+}
+
+/* Yield back to the context that resumed us */
 void co_yield(void) {
-    if (g_current->status == CO_STATUS_RUNNING)
+    if (g_current->node.status == CO_STATUS_RUNNING)
     {
-        g_current->status = CO_STATUS_WAITING;
-        co_return_to_main();
+        if (co_wait_begin(&g_current->node)) {
+            co_return_to_caller(NULL);
+        }
     }
     else
     {
-        __asm volatile ("bkpt #0");
+        co_port_break();
+    }
+}
+
+/* Switch directly to another coroutine, without going through main */
+void co_transfer(co_t *next) {
+    if ((g_current->node.status != CO_STATUS_RUNNING) ||
+        (next->node.status == CO_STATUS_FINISHED) || (next->node.status == CO_STATUS_RUNNING) || (next->node.status == CO_STATUS_MAIN)) {
+        co_port_break();
+        return;
+    }
+
+    if (co_wait_begin(&g_current->node) == 0) {
+        // Already resumed from interrupt, run again after next
+        g_current->node.status = CO_STATUS_WAITING;
+        co_wake(&g_current->node);
+    }
+#if CO_SHARED_STACK
+    if (!co_shared_claim(next)) {
+        // next needs the shared stack we are running on, let co_loop run it
+        co_wake(&next->node);
+        co_return_to_caller(NULL);
+        return;
+    }
+#endif
+    co_switch_to(next);
+}
+
+/* Yield, handing over directly to a coroutine resumed from interrupt if any */
+void co_yield_next(void) {
+    if (g_current->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return;
+    }
+
+    if (co_wait_begin(&g_current->node) == 0) {
+        return;
+    }
+
+    co_wait_switch();
+}
+
+/* Hand a value to the caller and wait, as co_yield. The value is never
+   dropped: with a wakeup from interrupt pending, the coroutine is queued for
+   co_loop instead of going on.
+*/
+void *co_yield_value(void *value) {
+    if (g_current->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return NULL;
+    }
+
+    if (co_wait_begin(&g_current->node) == 0) {
+        g_current->node.status = CO_STATUS_WAITING;
+        co_wake(&g_current->node);
+    }
+    return co_return_to_caller(value);
+}
+
+/* Resume a coroutine with a value; returns the value it yields, if any */
+void *co_resume_with(co_t *co, void *value) {
+    if ((co->node.status == CO_STATUS_FINISHED) || (co->node.status == CO_STATUS_MAIN) ||
+        (co->node.status == CO_STATUS_RUNNING) || co_port_in_isr()) {
+        co_port_break();
+        return NULL;
+    }
+#if !CO_NESTED_RESUME
+    if (g_current != &g_main_co) {
+        co_port_break();    // from a coroutine only with CO_NESTED_RESUME
+        return NULL;
+    }
+#endif
+
+#if CO_SHARED_STACK
+    if (!co_shared_claim(co)) {
+        co_port_break();    // not from the shared stack, nor under its holder
+        return NULL;
     }
+#endif
+    // prev stays running, blocked here until co yields back to it
+    co_t *prev = g_current;
+#if CO_NESTED_RESUME
+    co->caller = prev;
+#endif
+    g_current  = co;
+    co_set_running(&co->node);
+    value = co_context_switch(prev, co, value);
+    g_current  = prev;
+    return value;
 }
 
 /* Resume a coroutine; returns when it yields or finishes */
 void co_resume(co_t *co) {
-    if ((co->status == CO_STATUS_FINISHED) || (co->status == CO_STATUS_RUNNING) || (co->status == CO_STATUS_MAIN)) {
-        __asm volatile ("bkpt #0");
+    if ((co->node.status == CO_STATUS_FINISHED) || (co->node.status == CO_STATUS_MAIN)) {
+        co_port_break();
         return;
     }
 
-    uint32_t ipsr;
-    __asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
-    if (ipsr != 0) {
-        // Called from interrupt context, do not switch yet, flag for later
-        co->status = CO_STATUS_READY;
+    if (co_port_in_isr()) {
+        // Called from interrupt context, do not switch yet, queue for later
+        co_wake(&co->node);
+    }
+    else if (co->node.status == CO_STATUS_RUNNING) {
+        co_port_break();
     }
     else {
-        co_t *prev = g_current;
-        g_current  = co;
-        g_current->status = CO_STATUS_RUNNING;
-        context_switch(&prev->sp, &co->sp);
-        g_current  = prev;
+        (void)co_resume_with(co, NULL);
     }
 }
 
 void co_sleep(uint32_t ms) {
-    if (g_current->status == CO_STATUS_RUNNING)
+    if (g_current->node.status == CO_STATUS_RUNNING)
     {
-        uint32_t start = HAL_GetTick();
+        uint32_t start = co_port_get_tick();
 
-        g_current->sleep_until = start + ms;
+        g_current->node.sleep_until = start + ms;
 
-        g_current->status = CO_STATUS_SLEEPING;
-        co_return_to_main();
+        g_current->node.status = CO_STATUS_SLEEPING;
+        co_sleep_insert(&g_current->node);
+        CO_TRACE_PUT(CO_TRACE_SLEEP, g_current, 0);
+        co_return_to_caller(NULL);
     }
     else
     {
-        __asm volatile ("bkpt #0");
+        co_port_break();
     }
 }
 
 void co_loop(void)
 {
-    co_t *p = g_list;
-
-    uint32_t now = HAL_GetTick();
-    while (p) {
-        // If the coroutine is sleeping, check if it's time to wake it up
-        if (p->status == CO_STATUS_SLEEPING) {
-            if (now >= p->sleep_until) {
-                co_resume(p);
-            }
+    co_node_t *n;
+
+    // Sleepers are sorted, only the head needs to be checked
+    uint32_t now = co_port_get_tick();
+    while (g_sleep_head && ((int32_t)(now - g_sleep_head->sleep_until) >= 0)) {
+        n = g_sleep_head;
+        co_sleep_remove(n);
+        // A timed wait rather than co_sleep
+        if (n->status == CO_STATUS_WAITING) {
+            n->timed_out = 1;
         }
-        else if (p->status == CO_STATUS_READY) {
-            co_resume(p);
+        co_wake(n);
+    }
+
+    // Coroutines and tasks woken up or resumed from interrupt, in order
+    while ((n = co_ready_pop()) != NULL) {
+        if (n->task) {
+            co_task_run((co_task_t *)n);
+        }
+        else {
+            co_resume((co_t *)n);
         }
-        
-        p = p->next;
     }
 }
 
+co_poll_t co_poll(uint32_t *ticks) {
+    co_loop();
+
+    uint32_t idle = co_idle_time();
+    if (ticks) {
+        *ticks = idle;
+    }
+
+    if (idle == 0) {
+        return CO_POLL_READY;
+    }
+    return (idle == CO_IDLE_FOREVER) ? CO_POLL_IDLE : CO_POLL_DEADLINE;
+}
+
+uint32_t co_idle_time(void) {
+    uint32_t ticks = CO_IDLE_FOREVER;
+    uint32_t irq = co_port_irq_save();
+    if (g_ready_map) {
+        ticks = 0;
+    }
+    else if (g_sleep_head) {
+        int32_t left = (int32_t)(g_sleep_head->sleep_until - co_port_get_tick());
+        ticks = (left > 0) ? (uint32_t)left : 0;
+    }
+    co_port_irq_restore(irq);
+    return ticks;
+}
+
+#if CO_STACK_INFO
+size_t co_stack_used(const co_t *co) {
+    // The guard itself cannot be read from the coroutine it protects
+    const uint32_t *p   = co->stack_base + (CO_PORT_GUARD_BYTES / sizeof(uint32_t));
+    const uint32_t *end = co->stack_base + (co->stack_size / sizeof(uint32_t));
+    while ((p < end) && (*p == CO_STACK_PAINT_WORD)) {
+        ++p;
+    }
+    return co->stack_size - (size_t)((const uint8_t *)p - (const uint8_t *)co->stack_base);
+}
+
+size_t co_stack_free(const co_t *co) {
+    return co->stack_size - co_stack_used(co);
+}
+
+size_t co_stack_summary(co_stack_info_t *info, size_t max) {
+    size_t n = 0;
+    for (co_t *p = g_list; p; p = p->next, ++n) {
+        if (n < max) {
+            info[n].co   = p;
+            info[n].size = p->stack_size;
+            info[n].used = co_stack_used(p);
+        }
+    }
+    return n;
+}
+#endif
+
 co_t * co_current(void) {
-    if (g_current->status == CO_STATUS_MAIN) {
+    if (g_current->node.status == CO_STATUS_MAIN) {
         return NULL;
     }
 
     return g_current;
 }
 
+#if CO_TRACE
+void co_trace_init(void) {
+    uint32_t irq = co_port_irq_save();
+    if ((g_trace.magic != CO_TRACE_MAGIC) || ((g_trace.head - g_trace.tail) > 0x80000000u)) {
+        g_trace.head  = 0;
+        g_trace.tail  = 0;
+        g_trace.magic = CO_TRACE_MAGIC;
+    }
+    co_port_irq_restore(irq);
+}
+
+size_t co_trace_drain(co_trace_rec_t *dst, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        uint32_t irq  = co_port_irq_save();
+        uint32_t head = g_trace.head;
+        uint32_t lost = head - g_trace.tail;
+        if (lost > CO_TRACE_SIZE) {
+            // Overwritten, resume at the oldest record still there
+            lost -= CO_TRACE_SIZE;
+            g_trace.tail = head - CO_TRACE_SIZE;
+            dst[n].time  = g_trace.rec[g_trace.tail & (CO_TRACE_SIZE - 1)].time;
+            dst[n].co    = 0;
+            dst[n].event = CO_TRACE_LOST;
+            dst[n].arg   = (lost > 255) ? 255 : (uint8_t)lost;
+        }
+        else if (lost == 0) {
+            co_port_irq_restore(irq);
+            break;
+        }
+        else {
+            dst[n] = g_trace.rec[g_trace.tail & (CO_TRACE_SIZE - 1)];
+            ++g_trace.tail;
+        }
+        co_port_irq_restore(irq);
+        ++n;
+    }
+    return n;
+}
+
+/* who is a co_t or co_task_t, the main context is recorded as 0 */
+static void co_trace_put(uint8_t event, const void *who, uint8_t arg) {
+    uint32_t irq = co_port_irq_save();
+    co_trace_rec_t *r = &g_trace.rec[g_trace.head & (CO_TRACE_SIZE - 1)];
+    r->time  = co_port_trace_time();
+    r->co    = (who == &g_main_co) ? 0 : (uint16_t)(uintptr_t)who;
+    r->event = event;
+    r->arg   = arg;
+    g_trace.head = g_trace.head + 1;
+    co_port_irq_restore(irq);
+}
+#endif
+
+#if CO_CPU_STATS
+void co_cpu_stats(co_t *co, co_cpu_stats_t *stats, int reset) {
+    if (co == NULL) {
+        co = &g_main_co;
+    }
+    stats->time = co->cpu_time;
+    stats->runs = co->cpu_runs;
+    stats->max  = co->cpu_max;
+    if (reset) {
+        co->cpu_time = 0;
+        co->cpu_runs = 0;
+        co->cpu_max  = 0;
+        if (co == g_current) {
+            // The run in progress counts from now
+            co->cpu_start = co_port_cpu_time();
+        }
+    }
+}
+
+uint32_t co_cpu_now(void) {
+    return co_port_cpu_time();
+}
+#endif
+
+/* Register co in g_list, once. Returns 0 if it is in use. Whatever the
+   co_t held before, only a coroutine initialized and not finished since
+   has its key, so neither a stale nor a garbage co_t is linked twice.
+*/
+static int co_init_common(co_t *co, co_func fn) {
+    int registered = (co->key == CO_KEY(co));
+    if (registered && (co->node.status != CO_STATUS_IDLE)) {
+        co_port_break();    // ready, running, waiting or sleeping
+        return 0;
+    }
+    if (!registered) {
+        co_list_add(co);
+        co->key = CO_KEY(co);
+    }
+
+    co_node_init(&co->node);
+    co->fn        = fn;
+#if CO_JOIN
+    co->joiner    = NULL;
+    co->wait_slot = NULL;
+#endif
+#if CO_NESTED_RESUME
+    co->caller    = &g_main_co;
+#endif
+#if CO_CPU_STATS
+    co->cpu_time = 0;
+    co->cpu_runs = 0;
+    co->cpu_max  = 0;
+#endif
+#if CO_SHARED_STACK
+    if (g_shared_owner == co) {
+        // Its old frames are dead, nothing to save
+        g_shared_owner = NULL;
+    }
+#endif
+    return 1;
+}
+
+static void co_list_add(co_t *co) {
+#if CO_STACK_INFO
+    co->prev = NULL;
+    co->next = g_list;
+    if (g_list) {
+        g_list->prev = co;
+    }
+    g_list = co;
+#else
+    (void)co;
+#endif
+}
+
+static void co_list_remove(co_t *co) {
+#if CO_STACK_INFO
+    if (((co->prev ? co->prev->next : g_list) != co) ||
+        (co->next && (co->next->prev != co))) {
+        co_port_break();    // links overwritten while registered
+        return;
+    }
+    if (co->prev) {
+        co->prev->next = co->next;
+    }
+    else {
+        g_list = co->next;
+    }
+    if (co->next) {
+        co->next->prev = co->prev;
+    }
+#else
+    (void)co;
+#endif
+}
+
+static void co_node_init(co_node_t *n) {
+    n->ready_next = NULL;
+    n->sleep_next = NULL;
+    n->sleep_prev = NULL;
+    n->status = CO_STATUS_IDLE;
+    n->queued = 0;
+    n->wake_pending = 0;
+    n->sleeping = 0;
+    n->task = 0;
+    n->prio = 0;
+    n->timed_out = 0;
+    n->with_arg = 0;
+}
+
+#if CO_STACK_INFO
+static void co_paint(uint32_t *bottom, size_t stack_bytes) {
+#if CO_STACK_PAINT
+    size_t paint = stack_bytes / sizeof(uint32_t);
+#else
+    size_t paint = 16;
+    (void)stack_bytes;
+#endif
+    for (size_t i = 0; i < paint; ++i)
+    {
+        *bottom++ = CO_STACK_PAINT_WORD;
+    }
+}
+#endif
+
+void co_set_priority(co_t *co, uint32_t prio) {
+    co_set_prio(&co->node, prio);
+}
+
+void co_task_set_priority(co_task_t *task, uint32_t prio) {
+    co_set_prio(&task->node, prio);
+}
+
+void co_task_init(co_task_t *task, co_task_func fn) {
+    co_node_init(&task->node);
+    task->node.task = 1;
+    task->fn = fn;
+    task->lc = 0;
+}
+
+void co_task_resume(co_task_t *task) {
+    if (task->node.status == CO_STATUS_FINISHED) {
+        co_port_break();
+        return;
+    }
+
+    if (co_port_in_isr() || (g_current != &g_main_co)) {
+        // Tasks run on the main stack, queue for co_loop
+        co_wake(&task->node);
+    }
+    else if (task->node.status == CO_STATUS_RUNNING) {
+        co_port_break();
+    }
+    else {
+        co_task_run(task);
+    }
+}
+
+int co_task_wait(co_task_t *task) {
+    return co_wait_begin(&task->node);
+}
+
+void co_task_sleep(co_task_t *task, uint32_t ms) {
+    if (task->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return;
+    }
+    task->node.sleep_until = co_port_get_tick() + ms;
+    task->node.status = CO_STATUS_SLEEPING;
+    co_sleep_insert(&task->node);
+    CO_TRACE_PUT(CO_TRACE_SLEEP, task, 0);
+}
+
+void co_event_init(co_event_t *ev) {
+    ev->waiter = NULL;
+    ev->set = 0;
+}
+
+void co_event_wait(co_event_t *ev) {
+    (void)co_event_wait_timeout(ev, CO_WAIT_FOREVER);
+}
+
+co_wait_t co_event_wait_timeout(co_event_t *ev, uint32_t ms) {
+    if (g_current->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return CO_WAIT_TIMEOUT;
+    }
+    return co_event_wait_until(ev, co_port_get_tick() + ms, ms != CO_WAIT_FOREVER);
+}
+
+/* Resumed by anything else than the signal or the deadline: wait again */
+static co_wait_t co_event_wait_until(co_event_t *ev, uint32_t deadline, int timed) {
+    co_node_t *self = &g_current->node;
+    co_wait_t  result = CO_WAIT_WOKEN;
+#if CO_JOIN
+    g_current->wait_slot = &ev->waiter;
+#endif
+    while (co_event_begin_wait(ev, self)) {
+        if (!timed) {
+            co_wait_switch();
+        }
+        else if (co_wait_switch_until(deadline) == CO_WAIT_TIMEOUT) {
+            uint32_t irq = co_port_irq_save();
+            if (ev->waiter == self) {
+                ev->waiter = NULL;
+            }
+            // Signaled at the last moment, take it
+            if (!ev->set) {
+                result = CO_WAIT_TIMEOUT;
+            }
+            ev->set = 0;
+            co_port_irq_restore(irq);
+            break;
+        }
+    }
+#if CO_JOIN
+    g_current->wait_slot = NULL;
+#endif
+    return result;
+}
+
+void co_event_signal(co_event_t *ev) {
+    uint32_t irq = co_port_irq_save();
+    ev->set = 1;
+    if (ev->waiter) {
+        // A waiter still running (resumed by something else, or timed out)
+        // takes set at its next check. Waking it would leave wake_pending
+        // behind and end its next yield early.
+        if (ev->waiter->status != CO_STATUS_RUNNING) {
+            co_wake(ev->waiter);
+        }
+        ev->waiter = NULL;
+    }
+    co_port_irq_restore(irq);
+}
+
+void co_chan_init(co_chan_t *ch, uint8_t *buf, size_t size) {
+    if ((size == 0) || (size > 32768u) || (size & (size - 1))) {
+        co_port_break();    // power of two
+        return;
+    }
+    ch->buf  = buf;
+    ch->mask = (uint16_t)(size - 1);
+    ch->head = 0;
+    ch->tail = 0;
+    co_event_init(&ch->event);
+}
+
+int co_chan_get(co_chan_t *ch, uint8_t *byte) {
+    uint16_t tail = ch->tail;
+    if (ch->head == tail) {
+        return 0;
+    }
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);    // head before data
+    *byte = ch->buf[tail & ch->mask];
+    __atomic_signal_fence(__ATOMIC_RELEASE);    // data before tail
+    ch->tail = (uint16_t)(tail + 1);
+    return 1;
+}
+
+size_t co_chan_read(co_chan_t *ch, uint8_t *dst, size_t len) {
+    return co_chan_read_timeout(ch, dst, len, CO_WAIT_FOREVER);
+}
+
+size_t co_chan_read_timeout(co_chan_t *ch, uint8_t *dst, size_t len, uint32_t ms) {
+    if (g_current->node.status != CO_STATUS_RUNNING) {
+        co_port_break();
+        return 0;
+    }
+
+    // The producer signals when it makes the channel non-empty, a stale
+    // signal only costs one more check
+    uint32_t deadline = co_port_get_tick() + ms;
+    while (ch->head == ch->tail) {
+        if (co_event_wait_until(&ch->event, deadline, ms != CO_WAIT_FOREVER) == CO_WAIT_TIMEOUT) {
+            return 0;
+        }
+    }
+
+    size_t n = 0;
+    while ((n < len) && co_chan_get(ch, &dst[n])) {
+        ++n;
+    }
+    return n;
+}
+
+int co_task_event_wait(co_task_t *task, co_event_t *ev) {
+    return co_event_begin_wait(ev, &task->node);
+}
+
+/* Take the event if it is set and return 0. Otherwise register n as the
+   waiter, mark it waiting and return 1.
+*/
+static int co_event_begin_wait(co_event_t *ev, co_node_t *n) {
+    int wait = 0;
+    uint32_t irq = co_port_irq_save();
+    if (ev->set) {
+        ev->set = 0;
+        if (ev->waiter == n) {
+            ev->waiter = NULL;
+        }
+    }
+    else if (ev->waiter && (ev->waiter != n)) {
+        co_port_break();    // one waiter at a time
+    }
+    else {
+        ev->waiter = n;
+        n->status = CO_STATUS_WAITING;
+        wait = 1;
+        CO_TRACE_PUT(CO_TRACE_WAIT, n, 0);
+    }
+    co_port_irq_restore(irq);
+    return wait;
+}
+
+/* Takes effect the next time it is queued, an entry already in the ready
+   queue keeps its place.
+*/
+static void co_set_prio(co_node_t *n, uint32_t prio) {
+    if (prio >= CO_PRIORITIES) {
+        co_port_break();
+        return;
+    }
+    n->prio = (uint8_t)prio;
+}
+
+/* Run a task until its next wait point. Returning without one finishes it. */
+static void co_task_run(co_task_t *task) {
+    co_set_running(&task->node);
+    CO_TRACE_PUT(CO_TRACE_TASK_RUN, task, 0);
+    task->fn(task);
+    if (task->node.status == CO_STATUS_RUNNING) {
+        task->node.status = CO_STATUS_FINISHED;
+        CO_TRACE_PUT(CO_TRACE_FINISH, task, 0);
+    }
+    CO_TRACE_PUT(CO_TRACE_TASK_STOP, task, 0);
+}
+
 /* Entry point that runs on the coroutine's own stack */
-static void co_entry(void) {
+static void co_entry(void *arg) {
+    (void)arg;
     co_t *self = g_current;            /* set by co_resume before switching in */
     self->fn();                        /* run user code */
-    self->status = CO_STATUS_FINISHED; /* mark finished */
-    co_return_to_main();               /* return to main context */
+    co_finish(self);                   /* mark finished, return to the caller */
+}
+
+/* Same for co_init_arg, arg comes from the initial frame */
+static void co_entry_arg(void *arg) {
+    co_t *self = g_current;
+    ((co_func_arg)self->fn)(arg);
+    co_finish(self);
+}
+
+/* The function of the running coroutine returned. It leaves g_list and the
+   ready queue (a stale entry from a wakeup it no longer needs), so nothing
+   walks over finished coroutines and co_reset or co_init can reuse it.
+*/
+static void co_finish(co_t *self) {
+    uint32_t irq = co_port_irq_save();
+    self->node.status = CO_STATUS_FINISHED;
+    CO_TRACE_PUT(CO_TRACE_FINISH, self, 0);
+    if (self->node.queued) {
+        co_ready_remove(&self->node);
+    }
+    co_port_irq_restore(irq);
+
+    co_retire(self);
+    co_return_to_caller(NULL);
+}
+
+/* co is finished: it leaves g_list and loses its key, its joiner is woken
+   up and its pool slot, if any, is free again
+*/
+static void co_retire(co_t *co) {
+    co_list_remove(co);
+    co->key = 0;
+#if CO_JOIN
+    if (co->joiner) {
+        co_wake(co->joiner);
+        co->joiner = NULL;
+    }
+#endif
+#if CO_POOL
+    co_pool_release(co);
+#endif
+}
+
+/* Every switch goes through here, the incoming stack gets the guard */
+static void *co_context_switch(co_t *from, co_t *to, void *value) {
+#if CO_STACK_GUARD
+    co_port_guard_switch(to);
+#endif
+#if CO_CPU_STATS
+    co_cpu_account(from, to);
+#endif
+    CO_TRACE_PUT(CO_TRACE_SWITCH, to, 0);
+    return context_switch(&from->sp, &to->sp, value);
+}
+
+#if CO_CPU_STATS
+/* The run of from ends and the one of to starts */
+static void co_cpu_account(co_t *from, co_t *to) {
+    uint32_t now = co_port_cpu_time();
+    if (!g_cpu_started) {
+        // The very first switch leaves the main context, which was never
+        // switched in: its run starts here instead of at time 0
+        g_cpu_started = 1;
+        g_main_co.cpu_start = now;
+    }
+    uint32_t run = now - from->cpu_start;
+    from->cpu_time += run;
+    if (run > from->cpu_max) {
+        from->cpu_max = run;
+    }
+    to->cpu_start = now;
+    ++to->cpu_runs;
+}
+#endif
+
+/* Back to the main context or the coroutine that resumed the current one,
+   which restores g_current. Returns the value given by co_resume_with when
+   resumed again.
+*/
+static void *co_return_to_caller(void *value) {
+#if CO_NESTED_RESUME
+    return co_context_switch(g_current, g_current->caller, value);
+#else
+    return co_context_switch(g_current, &g_main_co, value);
+#endif
+}
+
+/* Coroutine to coroutine switch. next takes over the caller, so whoever
+   runs last returns to the co_resume that started the chain.
+*/
+static void co_switch_to(co_t *next) {
+    co_t *prev = g_current;
+#if CO_NESTED_RESUME
+    next->caller = prev->caller;
+#endif
+    g_current  = next;
+    co_set_running(&next->node);
+    (void)co_context_switch(prev, next, NULL);
+}
+
+/* The running coroutine waits: hand over directly to the next ready
+   coroutine if there is one, otherwise go back to the caller.
+*/
+static void co_wait_switch(void) {
+    co_node_t *n = co_ready_pop();
+    if (n && (n->task
+#if CO_SHARED_STACK
+              || !co_shared_claim((co_t *)n)
+#endif
+             )) {
+        // Tasks run on the main stack, leave it to co_loop
+        co_ready_push_front(n);
+        n = NULL;
+    }
+    if (n) {
+        co_switch_to((co_t *)n);
+    }
+    else {
+        co_return_to_caller(NULL);
+    }
+}
+
+/* Same as co_wait_switch, the running coroutine also goes in the sleep list
+   until deadline. co_loop sets timed_out if the deadline comes first,
+   otherwise co_set_running takes it out of the list when it is resumed.
+*/
+static co_wait_t co_wait_switch_until(uint32_t deadline) {
+    co_node_t *self = &g_current->node;
+    self->timed_out   = 0;
+    self->sleep_until = deadline;
+    co_sleep_insert(self);
+    co_wait_switch();
+    return self->timed_out ? CO_WAIT_TIMEOUT : CO_WAIT_WOKEN;
+}
+
+/* A coroutine or task resumed before its deadline leaves the sleep list */
+static void co_set_running(co_node_t *n) {
+    if (n->sleeping) {
+        co_sleep_remove(n);
+    }
+    n->status = CO_STATUS_RUNNING;
+}
+
+/* Make a coroutine or task ready from interrupt or coroutine context. If it
+   is still running (it has not reached co_yield yet), remember the wakeup so
+   co_yield returns immediately instead of losing it.
+*/
+static void co_wake(co_node_t *n) {
+    uint32_t irq = co_port_irq_save();
+    if (n->status == CO_STATUS_RUNNING) {
+        n->wake_pending = 1;
+    }
+    else if (n->status != CO_STATUS_READY) {
+        n->status = CO_STATUS_READY;
+        CO_TRACE_PUT(CO_TRACE_WAKE, n, (uint8_t)co_port_in_isr());
+        // Might still be queued if it was resumed directly meanwhile
+        if (!n->queued) {
+            uint8_t p = n->prio;
+            n->queued = 1;
+            n->ready_next = NULL;
+            if (g_ready_tail[p]) {
+                g_ready_tail[p]->ready_next = n;
+            }
+            else {
+                g_ready_head[p] = n;
+                g_ready_map |= 1u << p;
+            }
+            g_ready_tail[p] = n;
+        }
+    }
+    co_port_irq_restore(irq);
+}
+
+/* Next ready coroutine or task of the highest priority, or NULL. Skips
+   entries that were resumed directly after being queued.
+*/
+static co_node_t *co_ready_pop(void) {
+    co_node_t *n = NULL;
+    uint32_t irq = co_port_irq_save();
+    while (g_ready_map) {
+#if CO_PRIORITIES > 1
+        uint32_t p = co_port_highest_bit(g_ready_map);
+#else
+        uint32_t p = 0;
+#endif
+        n = g_ready_head[p];
+        g_ready_head[p] = n->ready_next;
+        if (g_ready_head[p] == NULL) {
+            g_ready_tail[p] = NULL;
+            g_ready_map &= ~(1u << p);
+        }
+        n->queued = 0;
+        if (n->status == CO_STATUS_READY) {
+            break;
+        }
+        n = NULL;
+    }
+    co_port_irq_restore(irq);
+    return n;
 }
 
-static void co_return_to_main(void) {
-    context_switch(&g_current->sp, &g_main_co.sp);
+/* Put back an entry just taken from the ready queue, keeping its turn */
+static void co_ready_push_front(co_node_t *n) {
+    uint32_t irq = co_port_irq_save();
+    if (!n->queued) {
+        uint8_t p = n->prio;
+        n->queued = 1;
+        n->ready_next = g_ready_head[p];
+        if (g_ready_head[p] == NULL) {
+            g_ready_tail[p] = n;
+            g_ready_map |= 1u << p;
+        }
+        g_ready_head[p] = n;
+    }
+    co_port_irq_restore(irq);
+}
+
+/* Unlink n from the ready queue, interrupts masked. Its priority may have
+   changed since it was queued, so every level is searched.
+*/
+static void co_ready_remove(co_node_t *n) {
+    for (uint32_t p = 0; p < CO_PRIORITIES; ++p) {
+        co_node_t *prev = NULL;
+        for (co_node_t *q = g_ready_head[p]; q; prev = q, q = q->ready_next) {
+            if (q != n) {
+                continue;
+            }
+            if (prev) {
+                prev->ready_next = n->ready_next;
+            }
+            else {
+                g_ready_head[p] = n->ready_next;
+            }
+            if (g_ready_tail[p] == n) {
+                g_ready_tail[p] = prev;
+            }
+            if (g_ready_head[p] == NULL) {
+                g_ready_map &= ~(1u << p);
+            }
+            n->queued = 0;
+            return;
+        }
+    }
+}
+
+/* Mark the running coroutine or task as waiting, unless it was already
+   resumed from interrupt since it last started running. Returns 0 in that
+   case, the caller must not switch out.
+*/
+static int co_wait_begin(co_node_t *n) {
+    int wait = 1;
+    uint32_t irq = co_port_irq_save();
+    if (n->wake_pending) {
+        n->wake_pending = 0;
+        wait = 0;
+    }
+    else {
+        n->status = CO_STATUS_WAITING;
+        CO_TRACE_PUT(CO_TRACE_WAIT, n, 0);
+    }
+    co_port_irq_restore(irq);
+    return wait;
+}
+
+/* Insert in deadline order, after sleepers with the same deadline.
+   Deadlines are compared through their signed difference, so the order
+   stays right when the tick wraps around (every 49 days at 1 ms), as long
+   as no sleep is longer than 2^31 ticks.
+*/
+static void co_sleep_insert(co_node_t *n) {
+    co_node_t *prev = NULL;
+    co_node_t *next = g_sleep_head;
+    while (next && ((int32_t)(next->sleep_until - n->sleep_until) <= 0)) {
+        prev = next;
+        next = next->sleep_next;
+    }
+    n->sleep_prev = prev;
+    n->sleep_next = next;
+    if (prev) {
+        prev->sleep_next = n;
+    }
+    else {
+        g_sleep_head = n;
+    }
+    if (next) {
+        next->sleep_prev = n;
+    }
+    n->sleeping = 1;
+}
+
+/* Doubly linked, so a sleeper woken before its deadline (a timed wait that
+   got its signal) leaves in O(1) wherever it sits in the list
+*/
+static void co_sleep_remove(co_node_t *n) {
+    if (n->sleep_prev) {
+        n->sleep_prev->sleep_next = n->sleep_next;
+    }
+    else {
+        g_sleep_head = n->sleep_next;
+    }
+    if (n->sleep_next) {
+        n->sleep_next->sleep_prev = n->sleep_prev;
+    }
+    n->sleeping = 0;
+}
+
+#if CO_SHARED_STACK
+/* Make sure co can be switched to from the current stack. A shared
+   coroutine that does not hold the shared stack gets it here: the holder's
+   used part, from its saved SP to the top, goes to its save buffer and co's
+   comes back to the same addresses, so the saved SP stays valid. That is
+   only possible while running on another stack. Returns 0 if the current
+   coroutine is itself on the shared stack, or the holder is up the caller
+   chain and must find its frames in place when it gets control back.
+*/
+static int co_shared_claim(co_t *co) {
+    if ((co->save_buf == NULL) || (g_shared_owner == co)) {
+        return 1;
+    }
+    if (g_current->save_buf != NULL) {
+        return 0;
+    }
+
+    co_t *owner = g_shared_owner;
+    if (owner && (owner->node.status == CO_STATUS_RUNNING)) {
+        return 0;   // up the caller chain, it resumes on the shared stack
+    }
+    if (owner && (owner->node.status != CO_STATUS_FINISHED)) {
+        uint32_t *sp = co_port_saved_sp(owner->sp);
+        uint32_t  n  = (uint32_t)(g_shared_top - sp);
+        if (n * sizeof(uint32_t) > owner->save_size) {
+            co_port_break();    // save buffer too small
+            n = owner->save_size / sizeof(uint32_t);
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            owner->save_buf[i] = sp[i];
+        }
+        owner->saved = n * sizeof(uint32_t);
+    }
+
+    if (co->saved) {
+        uint32_t *sp = g_shared_top - (co->saved / sizeof(uint32_t));
+        for (uint32_t i = 0; i < co->saved / sizeof(uint32_t); ++i) {
+            sp[i] = co->save_buf[i];
+        }
+    }
+    else {
+        co->sp = co_port_init_stack(g_shared_top, co_entry, NULL);
+    }
+    g_shared_owner = co;
+    return 1;
 }
+#endif
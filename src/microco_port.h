@@ -0,0 +1,393 @@
+/*
+ * microco_port.h - Architecture port layer of the coroutine library
+ *
+ * Everything that depends on the CPU or on the time source lives behind this
+ * header, so microco.c is the same for every target:
+ * - context_switch: implemented in assembly for each architecture, hands a
+ *   pointer-sized value over in registers.
+ * - co_port_init_stack: builds the initial frame that context_switch pops
+ *   into co_port_start, which calls the coroutine entry point with its
+ *   argument.
+ * - co_port_in_isr: tells if we are running in interrupt context.
+ * - co_port_irq_save / co_port_irq_restore: short critical sections shared
+ *   with interrupt handlers.
+ * - co_port_get_tick: millisecond time source used by co_sleep.
+ * - co_port_cpu_time: finer free-running counter for CO_CPU_STATS,
+ *   wrapping modulo 2^32.
+ * - co_port_trace_time: timestamp of a CO_TRACE record, as raw as the port
+ *   allows; microco_host/trace2json converts it.
+ * - co_port_break: stops on API misuse.
+ * - co_port_saved_sp: real address of a saved stack pointer.
+ * - co_port_highest_bit: index of the highest set bit, for the priority
+ *   bitmap of the ready queue and the free slots of the spawn pool.
+ * - co_port_guard_init / co_port_guard_switch: stack overflow guard, with
+ *   CO_STACK_GUARD. CO_PORT_GUARD_BYTES is the stack it takes.
+ *
+ * The port is selected from the compiler predefined macros:
+ * - __arm__:                   Cortex-M, context_switch_arm.S, HAL_GetTick
+ *                              (ARMv6-M or ARMv7-M variant, see that file)
+ * - __riscv, 32-bit:          RV32 machine mode, context_switch_rv32.S,
+ *                              co_port_get_tick provided by the application
+ * - __x86_64__ / __aarch64__:  Linux host, context_switch_host.S, port_host.c
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "microco.h"
+
+/* Save callee-saved registers on the current stack and its SP into *from_sp,
+   then load *to_sp into SP, restore callee-saved registers and return into
+   the target context. Implemented in assembly.
+
+   value travels in registers only: context_switch returns, in the target
+   context, the value given by whoever switched back to it.
+
+   The saved SP is opaque: with an FPU on Cortex-M, bit 0 tags a frame that
+   also holds s16-s31. Use co_port_saved_sp to get the real address.
+*/
+extern void *context_switch(uint32_t **from_sp, uint32_t **to_sp, void *value);
+
+/* First return address of a coroutine, implemented next to context_switch.
+   Moves the argument from the first callee-saved register of the initial
+   frame into the first argument register and jumps to the entry point held
+   in the second one. Never called from C.
+*/
+extern void co_port_start(void);
+
+/* Highest set bit of a non-zero word without CLZ, with a 16-entry table */
+static inline uint32_t co_port_highest_bit_table(uint32_t x) {
+    static const uint8_t log2_nibble[16] = { 0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+    uint32_t n = 0;
+    if (x >> 16) { x >>= 16; n += 16; }
+    if (x >> 8)  { x >>= 8;  n += 8; }
+    if (x >> 4)  { x >>= 4;  n += 4; }
+    return n + log2_nibble[x];
+}
+
+#if defined(__arm__)
+
+/* Provided by the STM32 HAL, 1 ms SysTick */
+extern uint32_t HAL_GetTick(void);
+
+static inline uint32_t co_port_get_tick(void) {
+    return HAL_GetTick();
+}
+
+static inline int co_port_in_isr(void) {
+    uint32_t ipsr;
+    __asm volatile ("mrs %0, ipsr" : "=r" (ipsr));
+    return ipsr != 0;
+}
+
+static inline uint32_t co_port_irq_save(void) {
+    uint32_t primask;
+    __asm volatile ("mrs %0, primask\n"
+                    "cpsid i" : "=r" (primask) :: "memory");
+    return primask;
+}
+
+static inline void co_port_irq_restore(uint32_t primask) {
+    __asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+}
+
+#if CO_CPU_STATS || CO_TRACE
+#define CO_SYST_LOAD (*(volatile uint32_t *)0xE000E014u)
+#define CO_SYST_VAL  (*(volatile uint32_t *)0xE000E018u)
+#define CO_SCB_ICSR  (*(volatile uint32_t *)0xE000ED04u)
+#define CO_ICSR_PENDSTSET (1u << 26)
+
+/* SysTick clocks since HAL_GetTick started: whole milliseconds from the
+   tick, the position within the current one from SysTick->VAL. No DWT, so
+   it works on the Cortex-M0+. ms * (LOAD + 1) wraps modulo 2^32 along with
+   the sum, differences stay right.
+*/
+static inline uint32_t co_port_cpu_time(void) {
+    uint32_t irq  = co_port_irq_save();
+    uint32_t load = CO_SYST_LOAD;
+    uint32_t ms   = HAL_GetTick();
+    uint32_t val  = CO_SYST_VAL;
+    // Reloaded while the tick interrupt is held off, ms is one behind
+    if ((CO_SCB_ICSR & CO_ICSR_PENDSTSET) && (val > (load >> 1))) {
+        ++ms;
+    }
+    co_port_irq_restore(irq);
+    return ms * (load + 1u) + (load - val);
+}
+
+#if CO_TRACE
+/* Same sources as co_port_cpu_time with only the reads left, as the ring
+   writer already masks interrupts: ms in bits 31-17, the tick interrupt
+   pending bit in bit 16, SysTick->VAL >> CO_TRACE_VAL_SHIFT in bits 15-0.
+   trace2json -l <LOAD> does the ms fix-up and the conversion.
+*/
+static inline uint32_t co_port_trace_time(void) {
+    uint32_t ms   = HAL_GetTick();
+    uint32_t val  = CO_SYST_VAL;
+    uint32_t pend = CO_SCB_ICSR & CO_ICSR_PENDSTSET;
+    return (ms << 17) | (pend >> 10) | (uint16_t)(val >> CO_TRACE_VAL_SHIFT);
+}
+#endif
+#endif
+
+static inline void co_port_break(void) {
+    __asm volatile ("bkpt #0");
+}
+
+static inline uint32_t * co_port_saved_sp(uint32_t *sp) {
+    return (uint32_t *)((uintptr_t)sp & ~(uintptr_t)1);
+}
+
+/* CLZ from ARMv7-M (and ARMv8-M Mainline), not on the Cortex-M0/M0+ */
+static inline uint32_t co_port_highest_bit(uint32_t x) {
+#if defined(__ARM_FEATURE_CLZ)
+    return 31u - (uint32_t)__builtin_clz(x);
+#else
+    return co_port_highest_bit_table(x);
+#endif
+}
+
+#if CO_STACK_GUARD && defined(__ARM_ARCH_8M_MAIN__)
+
+/* MSPLIM is set from co_t.stack_base inside context_switch */
+#define CO_PORT_GUARD_BYTES 0
+
+static inline void co_port_guard_init(co_t *co) {
+    (void)co;
+}
+
+static inline void co_port_guard_switch(co_t *co) {
+    (void)co;
+}
+
+#elif CO_STACK_GUARD && defined(__ARM_ARCH_8M_BASE__)
+#error "microco: CO_STACK_GUARD is not supported on ARMv8-M Baseline"
+#elif CO_STACK_GUARD
+
+/* PMSAv7 MPU of ARMv6-M and ARMv7-M. The smallest region that can be placed
+   anywhere is a 32-byte subregion: a 256-byte region with only the
+   subregion holding the stack bottom enabled, no access, execute never.
+*/
+#define CO_PORT_GUARD_BYTES 32
+
+#ifndef CO_STACK_GUARD_REGION
+#define CO_STACK_GUARD_REGION 7
+#endif
+
+#define CO_MPU_CTRL (*(volatile uint32_t *)0xE000ED94u)
+#define CO_MPU_RBAR (*(volatile uint32_t *)0xE000ED9Cu)
+#define CO_MPU_RASR (*(volatile uint32_t *)0xE000EDA0u)
+
+static inline void co_port_guard_init(co_t *co) {
+    uint32_t guard  = (uint32_t)co->stack_base;
+    uint32_t region = guard & ~255u;
+    uint32_t sub    = (guard - region) / 32u;
+
+    if (guard & 31u) {
+        co_port_break();    /* stack must be 32-byte aligned */
+    }
+
+    co->guard[0] = region | 0x10u | CO_STACK_GUARD_REGION;   /* VALID, REGION */
+    co->guard[1] = (1u << 28)                                /* XN */
+                 | (0u << 24)                                /* AP: no access */
+                 | ((0xFFu & ~(1u << sub)) << 8)             /* SRD */
+                 | (7u << 1)                                 /* SIZE: 256 bytes */
+                 | 1u;                                       /* ENABLE */
+
+    /* MPU on, default memory map for everything else */
+    CO_MPU_CTRL |= 0x5u;
+}
+
+/* Two stores per switch. The main context has no stack_base, the guard is
+   off while it runs.
+*/
+static inline void co_port_guard_switch(co_t *co) {
+    uint32_t irq = co_port_irq_save();
+    if (co->stack_base) {
+        CO_MPU_RBAR = co->guard[0];
+        CO_MPU_RASR = co->guard[1];
+    }
+    else {
+        CO_MPU_RBAR = 0x10u | CO_STACK_GUARD_REGION;
+        CO_MPU_RASR = 0;
+    }
+    __asm volatile ("dsb\n"
+                    "isb" ::: "memory");
+    co_port_irq_restore(irq);
+}
+
+#else
+#define CO_PORT_GUARD_BYTES 0
+#endif
+
+/* Prepare an initial "frame" so context_switch will pop into co_port_start,
+   which calls entry(arg) from r5 and r4.
+   Layout from low to high address: r8-r11, r4-r7, lr on ARMv6-M and
+   r4-r11, lr on ARMv7-M. The other registers start at zero.
+*/
+static inline uint32_t * co_port_init_stack(uint32_t *top, void (*entry)(void *), void *arg) {
+#if __ARM_ARCH_ISA_THUMB >= 2
+    const int r4 = 0;
+#else
+    const int r4 = 4;
+#endif
+    uint32_t *sp = top - 9;
+    for (int i = 0; i < 8; ++i) sp[i] = 0;
+    sp[r4]     = (uint32_t)arg;
+    sp[r4 + 1] = (uint32_t)entry;
+    sp[8]      = (uint32_t)co_port_start;  /* LR for first return in target context */
+    return sp;
+}
+
+#elif defined(__riscv) && (__riscv_xlen == 32)
+
+#if CO_STACK_GUARD
+#error "microco: CO_STACK_GUARD is not supported on RV32"
+#endif
+#define CO_PORT_GUARD_BYTES 0
+
+/* Provided by the application, 1 ms tick (for example from mtime) */
+uint32_t co_port_get_tick(void);
+
+/* Clock cycles, mcycle is always present in machine mode */
+static inline uint32_t co_port_cpu_time(void) {
+    uint32_t cycles;
+    __asm volatile ("csrr %0, mcycle" : "=r" (cycles));
+    return cycles;
+}
+
+static inline uint32_t co_port_trace_time(void) {
+    return co_port_cpu_time();
+}
+
+/* There is no IPSR on RISC-V. Taking a trap clears mstatus.MIE (the previous
+   value goes to MPIE) until mret, while thread code runs with MIE set. So MIE
+   clear means trap context. A co_resume from thread code with interrupts
+   masked is therefore deferred to co_loop, which is harmless. Handlers that
+   re-enable MIE to nest must not call co_resume afterwards.
+*/
+static inline int co_port_in_isr(void) {
+    uint32_t mstatus;
+    __asm volatile ("csrr %0, mstatus" : "=r" (mstatus));
+    return (mstatus & 0x8u) == 0;
+}
+
+static inline uint32_t co_port_irq_save(void) {
+    uint32_t mstatus;
+    __asm volatile ("csrrci %0, mstatus, 8" : "=r" (mstatus) :: "memory");
+    return mstatus & 0x8u;
+}
+
+static inline void co_port_irq_restore(uint32_t mie) {
+    __asm volatile ("csrs mstatus, %0" :: "r" (mie) : "memory");
+}
+
+static inline void co_port_break(void) {
+    __asm volatile ("ebreak");
+}
+
+static inline uint32_t * co_port_saved_sp(uint32_t *sp) {
+    return sp;
+}
+
+/* CLZ needs the Zbb extension */
+static inline uint32_t co_port_highest_bit(uint32_t x) {
+#if defined(__riscv_zbb)
+    return 31u - (uint32_t)__builtin_clz(x);
+#else
+    return co_port_highest_bit_table(x);
+#endif
+}
+
+/* Layout from low to high address: ra, s0-s11, 3 words padding to keep SP
+   16-byte aligned. co_port_start calls entry(arg) from s1 and s0.
+*/
+static inline uint32_t * co_port_init_stack(uint32_t *top, void (*entry)(void *), void *arg) {
+    uint32_t *sp = (uint32_t *)((uintptr_t)top & ~(uintptr_t)15);
+    sp -= 16;
+    for (int i = 0; i < 16; ++i) sp[i] = 0;
+    sp[0] = (uint32_t)co_port_start;  /* ra */
+    sp[1] = (uint32_t)arg;            /* s0 */
+    sp[2] = (uint32_t)entry;          /* s1 */
+    return sp;
+}
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+
+#if CO_STACK_GUARD
+#error "microco: CO_STACK_GUARD is not supported on the host"
+#endif
+#define CO_PORT_GUARD_BYTES 0
+
+/* Implemented in port_host.c, CLOCK_MONOTONIC in ms */
+uint32_t co_port_get_tick(void);
+
+/* Implemented in port_host.c, CLOCK_MONOTONIC in ns */
+uint32_t co_port_cpu_time(void);
+
+static inline uint32_t co_port_trace_time(void) {
+    return co_port_cpu_time();
+}
+
+/* There are no interrupts on the host. Signal handlers or test code that play
+   the role of an ISR bracket themselves with co_host_isr_enter/exit.
+*/
+extern volatile int co_host_isr_depth;
+
+static inline int co_port_in_isr(void) {
+    return co_host_isr_depth != 0;
+}
+
+/* Implemented in port_host.c: block signals, unless built with
+   CO_HOST_NO_SIGNALS where "interrupts" are plain synchronous calls and a
+   compiler barrier is enough.
+*/
+uint32_t co_port_irq_save(void);
+void co_port_irq_restore(uint32_t state);
+
+static inline void co_port_break(void) {
+    __builtin_trap();
+}
+
+static inline uint32_t * co_port_saved_sp(uint32_t *sp) {
+    return sp;
+}
+
+static inline uint32_t co_port_highest_bit(uint32_t x) {
+    return 31u - (uint32_t)__builtin_clz(x);
+}
+
+#if defined(__x86_64__)
+/* Layout from low to high address: r15, r14, r13, r12, rbx, rbp, return
+   address, padding. The padding leaves SP 16-byte aligned plus 8 at entry,
+   as if entry had been called. co_port_start calls entry(arg) from r12 and
+   rbx.
+*/
+static inline uint32_t * co_port_init_stack(uint32_t *top, void (*entry)(void *), void *arg) {
+    uintptr_t *sp = (uintptr_t *)((uintptr_t)top & ~(uintptr_t)15);
+    *--sp = 0;                          /* padding */
+    *--sp = (uintptr_t)co_port_start;   /* return address */
+    for (int i = 0; i < 6; ++i) *--sp = 0;
+    sp[3] = (uintptr_t)entry;           /* r12 */
+    sp[4] = (uintptr_t)arg;             /* rbx */
+    return (uint32_t *)sp;
+}
+#else
+/* Layout from low to high address: x19-x28, x29, x30, d8-d15.
+   co_port_start calls entry(arg) from x20 and x19.
+*/
+static inline uint32_t * co_port_init_stack(uint32_t *top, void (*entry)(void *), void *arg) {
+    uintptr_t *sp = (uintptr_t *)((uintptr_t)top & ~(uintptr_t)15);
+    sp -= 20;
+    for (int i = 0; i < 20; ++i) sp[i] = 0;
+    sp[0]  = (uintptr_t)arg;            /* x19 */
+    sp[1]  = (uintptr_t)entry;          /* x20 */
+    sp[11] = (uintptr_t)co_port_start;  /* x30 */
+    return (uint32_t *)sp;
+}
+#endif
+
+#else
+#error "microco: no port for this architecture"
+#endif
@@ -0,0 +1,77 @@
+/*
+ * port_host.c - Linux host port: time source and simulated interrupt context
+ *
+ * Only compiled in on x86-64 and AArch64, so it can sit in src/ next to the
+ * Cortex-M sources without affecting the target build.
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "microco.h"
+#include "microco_port.h"
+
+volatile int co_host_isr_depth = 0;
+
+uint32_t co_port_get_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u);
+}
+
+uint32_t co_port_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+}
+
+#if defined(CO_HOST_NO_SIGNALS)
+
+uint32_t co_port_irq_save(void) {
+    __asm volatile ("" ::: "memory");
+    return 0;
+}
+
+void co_port_irq_restore(uint32_t state) {
+    (void)state;
+    __asm volatile ("" ::: "memory");
+}
+
+#else
+
+static sigset_t g_saved_mask;
+static int      g_irq_nesting = 0;
+
+uint32_t co_port_irq_save(void) {
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+    if (g_irq_nesting++ == 0) {
+        g_saved_mask = old;
+    }
+    return 0;
+}
+
+void co_port_irq_restore(uint32_t state) {
+    (void)state;
+    if (--g_irq_nesting == 0) {
+        sigprocmask(SIG_SETMASK, &g_saved_mask, NULL);
+    }
+}
+
+#endif
+
+void co_host_isr_enter(void) {
+    co_host_isr_depth++;
+}
+
+void co_host_isr_exit(void) {
+    co_host_isr_depth--;
+}
+
+#endif